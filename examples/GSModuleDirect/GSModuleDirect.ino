@@ -11,6 +11,16 @@ static void print_line(const uint8_t *buf, uint16_t len, void *data) {
   static_cast<Print*>(data)->println();
 }
 
+static void print_scan_result(const GSModule::ScanResult *res, void *data) {
+  Print *p = static_cast<Print*>(data);
+  p->print(res->ssid);
+  p->print(" (channel ");
+  p->print(res->channel);
+  p->print(", RSSI ");
+  p->print(res->rssi);
+  p->println(")");
+}
+
 void setup() {
   Serial.begin(115200);
   Serial.println("Gainspan Serial2Wifi demo");
@@ -44,10 +54,10 @@ void setup() {
   gs.writeCommand("AT&V");
   gs.readResponse(print_line, &Serial);
 
-  // TODO: Add a proper API for scanning
   Serial.println("Scanning...");
-  gs.writeCommand("AT+WS");
-  gs.readResponse(print_line, &Serial);
+  int found = gs.scan(print_scan_result, &Serial);
+  Serial.print(found);
+  Serial.println(" networks found");
 
   // Enable DHCP
   gs.setDhcp(true, "pinoccio");
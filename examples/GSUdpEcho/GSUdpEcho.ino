@@ -0,0 +1,100 @@
+#include <GS.h>
+#include <SPI.h>
+
+GSModule gs;
+GSUdpServer server(gs);
+
+#define SSID "Foo"
+#define PASSPHRASE "Bar"
+
+// Define this to echo packets using the regular UDP API
+// (parsePacket/read/beginPacket/write/endPacket) instead of
+// recvFrom/sendTo, to compare the packet rates of both.
+//#define USE_UDP_API
+
+void setup() {
+  Serial.begin(115200);
+  Serial.println("Gainspan UDP echo / packet rate demo");
+  #ifdef VCC_ENABLE // For the Pinoccio scout
+  pinMode(VCC_ENABLE, OUTPUT);
+  digitalWrite(VCC_ENABLE, HIGH);
+  #endif
+  delay(2000);
+
+  // Use an UART
+  //Serial1.begin(115200);
+  //gs.begin(Serial1);
+
+  // Use SPI with SS on pin 7
+  gs.begin(7);
+
+  // Disable the NCM, just in case it was set to autostart. Wait a bit
+  // before doing so, because it seems that if the NCM is configured to
+  // start on boot and we try to disable it within the first second or
+  // so, the module locks up...
+  delay(1000);
+  gs.setNcm(false);
+
+  // Send the configuration commands back to back, instead of waiting
+  // for the reply to each of them
+  GSModule::GSResponse results[3];
+  gs.beginBatch(results, 3);
+
+  // Enable DHCP
+  gs.setDhcp(true, "pinoccio");
+
+  // Set up security
+  gs.setSecurity(GSModule::GS_SECURITY_WPA_PSK);
+  gs.setWpaPassphrase(PASSPHRASE);
+
+  if (!gs.endBatch())
+    Serial.println("Configuration failed");
+
+  // Associate
+  while(!gs.associate(SSID)) {
+    Serial.println("Association failed, retrying...");
+    gs.loop();
+  }
+
+  Serial.println("Associated to " SSID);
+
+  if(!server.begin(42424))
+    Serial.println("Bind failed");
+
+  Serial.println("setup() done, send packets to port 42424");
+}
+
+void loop() {
+  static uint32_t last = millis();
+  static uint32_t packets = 0;
+  static uint8_t buf[128];
+
+  gs.loop();
+
+#ifdef USE_UDP_API
+  if (server.parsePacket()) {
+    size_t len = server.read(buf, sizeof(buf));
+    server.beginPacket(server.remoteIP(), server.remotePort());
+    server.write(buf, len);
+    server.endPacket();
+    packets++;
+  }
+#else
+  IPAddress ip;
+  uint16_t port;
+  int len = server.recvFrom(buf, sizeof(buf), &ip, &port);
+  if (len >= 0) {
+    server.sendTo(ip, port, buf, len);
+    packets++;
+  }
+#endif
+
+  if ((uint32_t)(millis() - last) >= 1000) {
+    Serial.print(packets);
+    Serial.println(" packets/s");
+    packets = 0;
+    last = millis();
+  }
+}
+
+/* vim: set filetype=cpp softtabstop=2 shiftwidth=2 expandtab: */
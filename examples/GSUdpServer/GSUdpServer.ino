@@ -6,12 +6,6 @@ GSModule gs;
 #define SSID "Foo"
 #define PASSPHRASE "Bar"
 
-static void print_line(const uint8_t *buf, uint16_t len, void *data) {
-  static_cast<Print*>(data)->write(buf, len);
-  static_cast<Print*>(data)->println();
-}
-
-
 void setup() {
   Serial.begin(115200);
   Serial.println("Gainspan UDP Server demo");
@@ -49,8 +43,13 @@ void setup() {
   }
 
   Serial.println("Associated to " SSID);
-  gs.writeCommand("AT+NSTAT=?");
-  gs.readResponse(print_line, &Serial);
+  const GSModule::Status *status = gs.getStatus();
+  if (status) {
+    Serial.print("IP address: ");
+    Serial.println(status->ip);
+    Serial.print("RSSI: ");
+    Serial.println(status->rssi);
+  }
 
   // UDP server
   GSUdpServer server(gs);
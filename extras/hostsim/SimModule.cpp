@@ -0,0 +1,178 @@
+/*
+ * Host-side simulator for the Gainspan Wifi2Serial library
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "SimModule.h"
+
+SimModule::SimModule()
+{
+  // Startup banner
+  reply("\r\nSerial2WiFi APP\r\n");
+}
+
+int SimModule::available()
+{
+  int count = 0;
+  for (const Byte& b : this->out) {
+    if (b.time > sim_time)
+      break;
+    ++count;
+  }
+  return count;
+}
+
+int SimModule::peek()
+{
+  if (this->out.empty() || this->out.front().time > sim_time)
+    return -1;
+  return this->out.front().c;
+}
+
+int SimModule::read()
+{
+  int c = peek();
+  if (c == -1)
+    sim_time += POLL_TIME;
+  else
+    this->out.pop_front();
+  return c;
+}
+
+void SimModule::reply(const char *s, unsigned delay)
+{
+  reply((const uint8_t*)s, strlen(s), delay);
+}
+
+void SimModule::reply(const uint8_t *buf, size_t len, unsigned delay)
+{
+  uint64_t time = sim_time + delay;
+  if (!this->out.empty() && this->out.back().time > time)
+    time = this->out.back().time;
+
+  while (len--) {
+    time += BYTE_TIME;
+    this->out.push_back({time, *buf++});
+  }
+}
+
+void SimModule::processLine()
+{
+  this->commands.push_back(this->line);
+
+  bool ok = (this->line.compare(0, 2, "AT") == 0);
+  if (this->line == "ATV0")
+    this->verbose = false;
+  else if (this->line == "ATV1")
+    this->verbose = true;
+
+  if (this->line.compare(0, 9, "AT+NCTCP=") == 0) {
+    uint8_t cid = 0;
+    while (cid < 16 && (this->connected & (1 << cid)))
+      ++cid;
+    this->line.clear();
+    if (cid == 16) {
+      reply(this->verbose ? "\r\nERROR: NO CID\r\n" : "4\r\n");
+      return;
+    }
+    this->connected |= (1 << cid);
+    char buf[32];
+    snprintf(buf, sizeof(buf), this->verbose ? "\r\nCONNECT %x\r\n\r\nOK\r\n" : "7 %x\r\n0\r\n", cid);
+    reply(buf, this->connect_delay);
+    return;
+  }
+
+  if (this->line.compare(0, 10, "AT+NCLOSE=") == 0)
+    this->connected &= ~(1 << strtoul(this->line.c_str() + 10, NULL, 16));
+
+  bool slow = !this->slow_command.empty() && this->line == this->slow_command;
+  unsigned delay = slow ? this->slow_delay : this->reply_delay;
+  this->line.clear();
+  if (slow && !delay)
+    return;
+
+  if (this->verbose)
+    reply(ok ? "\r\nOK\r\n" : "\r\nERROR: INVALID INPUT\r\n", delay);
+  else
+    reply(ok ? "0\r\n" : "2\r\n", delay);
+}
+
+size_t SimModule::write(uint8_t c)
+{
+  sim_time += BYTE_TIME;
+
+  switch (this->state) {
+    case CMD:
+      if (c == 0x1b) {
+        this->state = ESC;
+      } else if (c == '\r' || c == '\n') {
+        if (!this->line.empty())
+          processLine();
+      } else {
+        this->line += (char)c;
+      }
+      break;
+
+    case ESC:
+      this->state = (c == 'Z') ? ESC_Z_CID : CMD;
+      break;
+
+    case ESC_Z_CID:
+      this->cid = (c >= 'a') ? c - 'a' + 10 : c - '0';
+      if (this->reject_frames & (1UL << (this->frames++ % 32))) {
+        // The rest of the frame goes to the command interpreter
+        reply("\x1b" "F");
+        this->state = CMD;
+      } else {
+        reply("\x1b" "O");
+        this->len = this->len_digits = 0;
+        this->frame.clear();
+        this->state = ESC_Z_LEN;
+      }
+      break;
+
+    case ESC_Z_LEN:
+      this->len = this->len * 10 + (c - '0');
+      if (++this->len_digits == 4)
+        this->state = this->len ? ESC_Z_DATA : CMD;
+      break;
+
+    case ESC_Z_DATA:
+      this->received[this->cid & 0xf] += (char)c;
+      this->frame += (char)c;
+      if (--this->len == 0) {
+        this->state = CMD;
+        if (this->echo_delay) {
+          char header[8];
+          snprintf(header, sizeof(header), "\x1bZ%x%04u", this->cid, (unsigned)this->frame.size());
+          reply(header, this->echo_delay);
+          reply((const uint8_t*)this->frame.data(), this->frame.size(), 0);
+        }
+      }
+      break;
+  }
+  return 1;
+}
+
+// vim: set sw=2 sts=2 expandtab:
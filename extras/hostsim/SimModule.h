@@ -0,0 +1,147 @@
+/*
+ * Host-side simulator for the Gainspan Wifi2Serial library
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HOSTSIM_SIM_MODULE_H
+#define HOSTSIM_SIM_MODULE_H
+
+/*
+ * This directory allows running the library on a regular computer, talking
+ * to a simulated module over a fake serial port. Time is simulated as
+ * well: writing or receiving a byte takes BYTE_TIME microseconds and
+ * polling for a byte that is not there yet takes POLL_TIME, so timings
+ * are reproducible and timeouts do not take real time.
+ *
+ * Build and run the tests and benchmarks from this directory with:
+ *
+ *   for t in test_tx_resync test_timeout test_pool bench_tx bench_pool; do
+ *     g++ -std=gnu++11 -O2 -Istubs -I../../src/GSModule -o $t $t.cpp \
+ *         SimModule.cpp stubs/Arduino.cpp ../../src/GSModule/GSCore.cpp \
+ *         ../../src/GSModule/GSModule.cpp ../../src/GSModule/GSClient.cpp \
+ *         ../../src/GSModule/GSTcpClient.cpp ../../src/GSModule/GSTcpPool.cpp \
+ *       && ./$t
+ *   done
+ */
+
+#include <Arduino.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+/** The simulated time in microseconds since startup */
+extern uint64_t sim_time;
+
+/**
+ * A simulated module, connected through a serial port. It only knows
+ * about AT commands in general (which it acknowledges without doing
+ * anything), AT+NCTCP and AT+NCLOSE, and <ESC>Z data frames, which is
+ * enough to exercise the command and data paths of the library. It
+ * starts out in verbose mode (until ATV0), but with echo already
+ * disabled.
+ */
+class SimModule : public Stream {
+public:
+  SimModule();
+
+  virtual int available();
+  virtual int read();
+  virtual int peek();
+  virtual size_t write(uint8_t c);
+  using Print::write;
+
+  /** Time to transfer a single byte (115200 baud) */
+  static const unsigned BYTE_TIME = 87;
+  /** Time taken by a single read() call that finds no data */
+  static const unsigned POLL_TIME = 10;
+
+  /** Time between receiving a command or frame header and replying */
+  unsigned reply_delay = 1000;
+
+  /**
+   * When bit n is set, the nth data frame (counting from 0) is rejected
+   * with <ESC>F, as the real module does e.g. when its buffers are full.
+   * The rest of the frame then ends up at the command interpreter.
+   */
+  uint32_t reject_frames = 0;
+
+  /**
+   * The reply to this command line is sent after slow_delay instead of
+   * reply_delay, or never when slow_delay is 0.
+   */
+  std::string slow_command;
+  unsigned slow_delay = 0;
+
+  /** Time for AT+NCTCP to set up a connection */
+  unsigned connect_delay = 50000;
+
+  /**
+   * When not 0, data accepted for a connection is sent back after this
+   * time, as if the remote end echoes it.
+   */
+  unsigned echo_delay = 0;
+
+  /** The number of data frames seen */
+  unsigned frames = 0;
+  /** The data accepted for each cid */
+  std::string received[16];
+  /** All command lines seen, including garbage from rejected frames */
+  std::vector<std::string> commands;
+
+protected:
+  /** Send the given bytes after the given delay */
+  void reply(const char *s, unsigned delay);
+  void reply(const char *s) { reply(s, this->reply_delay); }
+  void reply(const uint8_t *buf, size_t len, unsigned delay);
+  void processLine();
+
+  enum {
+    CMD,
+    ESC,
+    ESC_Z_CID,
+    ESC_Z_LEN,
+    ESC_Z_DATA,
+  } state = CMD;
+
+  bool verbose = true;
+  std::string line;
+  uint8_t cid;
+  uint8_t len_digits;
+  uint16_t len;
+  /** Bit n is set when cid n is connected */
+  uint16_t connected = 0;
+  /** Data of the frame being received, for echo_delay */
+  std::string frame;
+
+  struct Byte {
+    /** The sim_time at which this byte is available */
+    uint64_t time;
+    uint8_t c;
+  };
+  std::deque<Byte> out;
+};
+
+#endif // HOSTSIM_SIM_MODULE_H
+
+// vim: set sw=2 sts=2 expandtab:
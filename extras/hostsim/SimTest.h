@@ -0,0 +1,58 @@
+/*
+ * Host-side simulator for the Gainspan Wifi2Serial library
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HOSTSIM_SIM_TEST_H
+#define HOSTSIM_SIM_TEST_H
+
+/*
+ * Minimal helpers for the simulator tests, see SimModule.h.
+ */
+
+#include <stdio.h>
+
+static unsigned failures = 0;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    ++failures; \
+  } \
+} while (0)
+
+/** Print the test results and return the exit code for main() */
+static int report()
+{
+  if (failures) {
+    printf("%u checks failed\n", failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
+
+#endif // HOSTSIM_SIM_TEST_H
+
+// vim: set sw=2 sts=2 expandtab:
@@ -0,0 +1,120 @@
+/*
+ * Host-side simulator for the Gainspan Wifi2Serial library
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Latency benchmark for GSTcpPool: requests on reused (warm)
+ * connections compared to requests that set up a new (cold)
+ * connection, using simulated time. See SimModule.h for how to build
+ * and run this.
+ */
+
+#include <GSModule.h>
+#include <GSTcpClient.h>
+#include <GSTcpPool.h>
+#include "SimModule.h"
+
+static const char request[] = "GET / HTTP/1.1\r\nHost: example\r\n\r\n";
+
+/**
+ * Do a single request and wait for the reply. Returns the simulated
+ * time it took, in microseconds, or 0 on failure.
+ */
+static uint64_t do_request(GSTcpClient &client)
+{
+  uint64_t start = sim_time;
+  if (!client.connect(IPAddress(10, 0, 0, 1), 80))
+    return 0;
+
+  client.write((const uint8_t*)request, sizeof(request) - 1);
+  client.flush();
+
+  // The simulated server echoes the request
+  size_t received = 0;
+  while (received < sizeof(request) - 1) {
+    if ((sim_time - start) > 1000000)
+      return 0;
+    if (client.read() >= 0)
+      ++received;
+  }
+
+  client.stop();
+  return sim_time - start;
+}
+
+static void run(bool pooled, unsigned count)
+{
+  SimModule sim;
+  sim.echo_delay = 20000;
+  GSModule gs;
+  if (!gs.begin(sim)) {
+    printf("begin failed\n");
+    return;
+  }
+
+  GSTcpPool pool(gs);
+  uint64_t first = 0, total = 0;
+  for (unsigned i = 0; i < count; ++i) {
+    uint64_t time;
+    if (pooled) {
+      GSTcpClient client(gs, pool);
+      time = do_request(client);
+    } else {
+      GSTcpClient client(gs);
+      time = do_request(client);
+    }
+    if (!time) {
+      printf("request %u failed\n", i);
+      return;
+    }
+    if (i == 0)
+      first = time;
+    else
+      total += time;
+  }
+
+  printf("%-9s  first request %6.1fms, later requests %6.1fms on average\n",
+         pooled ? "pool" : "no pool", first / 1000.0, total / 1000.0 / (count - 1));
+
+  if (pooled) {
+    const GSTcpPool::Stats& stats = pool.getStats();
+    printf("           %u cold checkouts: %8.0fus on average\n",
+           stats.cold, stats.cold ? (double)stats.cold_us / stats.cold : 0);
+    printf("           %u warm checkouts: %8.0fus on average\n",
+           stats.warm, stats.warm ? (double)stats.warm_us / stats.warm : 0);
+  }
+}
+
+int main()
+{
+  SimModule sim;
+  printf("connect takes %ums, the server replies after %ums\n\n",
+         sim.connect_delay / 1000, 20);
+  run(false, 20);
+  run(true, 20);
+  return 0;
+}
+
+// vim: set sw=2 sts=2 expandtab:
@@ -0,0 +1,89 @@
+/*
+ * Host-side simulator for the Gainspan Wifi2Serial library
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Throughput benchmark for writeData with different pipelining depths,
+ * using simulated time. See SimModule.h for how to build and run this.
+ */
+
+#include <GSCore.h>
+#include "SimModule.h"
+
+/**
+ * Write count frames of len bytes and return the (simulated) time it
+ * took in microseconds, or 0 when writing failed.
+ */
+static uint64_t run(uint8_t depth, uint16_t len, unsigned count, uint32_t reject_frames)
+{
+  SimModule sim;
+  GSCore gs;
+  if (!gs.begin(sim))
+    return 0;
+
+  gs.setTxPipelining(depth);
+  sim.reject_frames = reject_frames;
+
+  static uint8_t buf[GSCore::MAX_DATA_FRAME_SIZE];
+  memset(buf, 'x', len);
+
+  uint64_t start = sim_time;
+  for (unsigned i = 0; i < count; ++i)
+    gs.writeData(1, buf, len);
+  // Count the time until every frame is acknowledged and the module
+  // is ready for a command
+  if (!gs.flushData() || !gs.writeCommandCheckOk("AT") || gs.unrecoverableError)
+    return 0;
+  return sim_time - start;
+}
+
+int main()
+{
+  const unsigned count = 100;
+  const uint16_t sizes[] = {16, 128, 1400};
+  const uint8_t depths[] = {0, 1, 2, 4, 8};
+
+  printf("%u frames per run, reply delay %u us, %u us per byte\n\n",
+         count, SimModule().reply_delay, SimModule::BYTE_TIME);
+  printf("size  depth  rejects      time     kB/s\n");
+  for (uint16_t len : sizes) {
+    for (uint8_t depth : depths) {
+      // Without rejects, and with every 32nd frame rejected
+      for (uint32_t rejects : {0UL, 1UL}) {
+        uint64_t time = run(depth, len, count, rejects);
+        if (!time) {
+          printf("%4u  %5u  %7s    failed\n", len, depth, rejects ? "1/32" : "none");
+          continue;
+        }
+        printf("%4u  %5u  %7s  %6.1fms  %7.1f\n", len, depth,
+               rejects ? "1/32" : "none", time / 1000.0,
+               (double)len * count * 1000 / time);
+      }
+    }
+  }
+  return 0;
+}
+
+// vim: set sw=2 sts=2 expandtab:
@@ -0,0 +1,90 @@
+/*
+ * Implementation of the Arduino core stubs. Time is simulated, see
+ * ../SimModule.h.
+ */
+#include <Arduino.h>
+#include <IPAddress.h>
+#include <SPI.h>
+
+uint64_t sim_time = 0;
+
+SPIClass SPI;
+
+unsigned long millis() { return sim_time / 1000; }
+unsigned long micros() { return sim_time; }
+void delay(unsigned long ms) { sim_time += ms * 1000; }
+void delayMicroseconds(unsigned int us) { sim_time += us; }
+int digitalRead(uint8_t) { return LOW; }
+void digitalWrite(uint8_t, uint8_t) { }
+void pinMode(uint8_t, uint8_t) { }
+
+size_t Print::write(const uint8_t *buf, size_t len)
+{
+  size_t n = 0;
+  while (len--)
+    n += write(*buf++);
+  return n;
+}
+
+size_t Print::printNumber(unsigned long n, int base)
+{
+  char buf[8 * sizeof(n) + 1];
+  char *s = &buf[sizeof(buf) - 1];
+  *s = '\0';
+  do {
+    unsigned digit = n % base;
+    *--s = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    n /= base;
+  } while (n);
+  return write(s);
+}
+
+size_t Print::print(const __FlashStringHelper *s) { return write((const char*)s); }
+size_t Print::print(const char s[]) { return write(s); }
+size_t Print::print(char c) { return write((uint8_t)c); }
+size_t Print::print(unsigned char n, int base) { return printNumber(n, base); }
+size_t Print::print(unsigned int n, int base) { return printNumber(n, base); }
+size_t Print::print(unsigned long n, int base) { return printNumber(n, base); }
+size_t Print::print(int n, int base) { return print((long)n, base); }
+size_t Print::print(const Printable &p) { return p.printTo(*this); }
+
+size_t Print::print(long n, int base)
+{
+  if (n < 0 && base == 10)
+    return print('-') + printNumber(-(unsigned long)n, base);
+  return printNumber(n, base);
+}
+
+size_t Print::println() { return write("\r\n"); }
+size_t Print::println(const __FlashStringHelper *s) { return print(s) + println(); }
+size_t Print::println(const char s[]) { return print(s) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(unsigned char n, int base) { return print(n, base) + println(); }
+size_t Print::println(int n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned int n, int base) { return print(n, base) + println(); }
+size_t Print::println(long n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned long n, int base) { return print(n, base) + println(); }
+size_t Print::println(const Printable &p) { return print(p) + println(); }
+
+size_t Stream::readBytes(char *buf, size_t len)
+{
+  size_t n = 0;
+  while (n < len) {
+    int c = read();
+    if (c < 0)
+      break;
+    buf[n++] = c;
+  }
+  return n;
+}
+
+size_t IPAddress::printTo(Print &p) const
+{
+  size_t n = 0;
+  for (uint8_t i = 0; i < 4; ++i) {
+    if (i)
+      n += p.print('.');
+    n += p.print(bytes[i], DEC);
+  }
+  return n;
+}
@@ -0,0 +1,31 @@
+#ifndef HOSTSIM_IPADDRESS_H
+#define HOSTSIM_IPADDRESS_H
+
+#include <stdint.h>
+#include <string.h>
+#include "Printable.h"
+
+class IPAddress : public Printable {
+public:
+  IPAddress() { memset(bytes, 0, sizeof(bytes)); }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { bytes[0] = a; bytes[1] = b; bytes[2] = c; bytes[3] = d; }
+  IPAddress(uint32_t address) { memcpy(bytes, &address, sizeof(bytes)); }
+  IPAddress(const uint8_t *address) { memcpy(bytes, address, sizeof(bytes)); }
+
+  operator uint32_t() const { uint32_t a; memcpy(&a, bytes, sizeof(a)); return a; }
+  bool operator==(const IPAddress &other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+  bool operator==(const uint8_t *addr) const { return memcmp(bytes, addr, sizeof(bytes)) == 0; }
+  uint8_t operator[](int index) const { return bytes[index]; }
+  uint8_t& operator[](int index) { return bytes[index]; }
+  IPAddress& operator=(const uint8_t *address) { memcpy(bytes, address, sizeof(bytes)); return *this; }
+  IPAddress& operator=(uint32_t address) { memcpy(bytes, &address, sizeof(bytes)); return *this; }
+
+  virtual size_t printTo(Print &p) const;
+
+private:
+  uint8_t bytes[4];
+};
+
+const IPAddress INADDR_NONE(0, 0, 0, 0);
+
+#endif // HOSTSIM_IPADDRESS_H
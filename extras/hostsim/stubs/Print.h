@@ -0,0 +1,46 @@
+#ifndef HOSTSIM_PRINT_H
+#define HOSTSIM_PRINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+class __FlashStringHelper;
+class Printable;
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buf, size_t len);
+  size_t write(const char *str) { return str ? write((const uint8_t*)str, strlen(str)) : 0; }
+  size_t write(const char *buf, size_t len) { return write((const uint8_t*)buf, len); }
+  virtual int availableForWrite() { return 0; }
+  virtual void flush() {}
+
+  size_t print(const __FlashStringHelper *s);
+  size_t print(const char s[]);
+  size_t print(char c);
+  size_t print(unsigned char n, int base = 10);
+  size_t print(int n, int base = 10);
+  size_t print(unsigned int n, int base = 10);
+  size_t print(long n, int base = 10);
+  size_t print(unsigned long n, int base = 10);
+  size_t print(const Printable &p);
+
+  size_t println(const __FlashStringHelper *s);
+  size_t println(const char s[]);
+  size_t println(char c);
+  size_t println(unsigned char n, int base = 10);
+  size_t println(int n, int base = 10);
+  size_t println(unsigned int n, int base = 10);
+  size_t println(long n, int base = 10);
+  size_t println(unsigned long n, int base = 10);
+  size_t println(const Printable &p);
+  size_t println();
+
+private:
+  size_t printNumber(unsigned long n, int base);
+};
+
+#endif // HOSTSIM_PRINT_H
@@ -0,0 +1,12 @@
+#ifndef HOSTSIM_PRINTABLE_H
+#define HOSTSIM_PRINTABLE_H
+
+#include "Print.h"
+
+class Printable {
+public:
+  virtual ~Printable() {}
+  virtual size_t printTo(Print &p) const = 0;
+};
+
+#endif // HOSTSIM_PRINTABLE_H
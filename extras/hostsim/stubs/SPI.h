@@ -0,0 +1,28 @@
+#ifndef HOSTSIM_SPI_H
+#define HOSTSIM_SPI_H
+
+#include "Arduino.h"
+
+// The simulator only uses the serial interface, SPI is never selected
+#define SPI_HAS_TRANSACTION 1
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+class SPISettings {
+public:
+  SPISettings() {}
+  SPISettings(uint32_t, uint8_t, uint8_t) {}
+};
+
+class SPIClass {
+public:
+  static void begin() {}
+  static void end() {}
+  static void beginTransaction(SPISettings) {}
+  static void endTransaction() {}
+  static uint8_t transfer(uint8_t) { return 0xff; }
+};
+
+extern SPIClass SPI;
+
+#endif // HOSTSIM_SPI_H
@@ -0,0 +1,15 @@
+#ifndef HOSTSIM_STREAM_H
+#define HOSTSIM_STREAM_H
+
+#include "Print.h"
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  size_t readBytes(char *buf, size_t len);
+  size_t readBytes(uint8_t *buf, size_t len) { return readBytes((char*)buf, len); }
+};
+
+#endif // HOSTSIM_STREAM_H
@@ -0,0 +1,95 @@
+/*
+ * Host-side simulator for the Gainspan Wifi2Serial library
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Tests for GSTcpPool. See SimModule.h for how to build and run this.
+ */
+
+#include <GSModule.h>
+#include <GSTcpPool.h>
+#include "SimModule.h"
+#include "SimTest.h"
+
+static const IPAddress ip(10, 0, 0, 1);
+
+/* An idle connection is reused for the same destination */
+static void test_reuse()
+{
+  SimModule sim;
+  GSModule gs;
+  CHECK(gs.begin(sim));
+  GSTcpPool pool(gs);
+
+  GSCore::cid_t cid = pool.checkout(ip, 80);
+  CHECK(cid != GSCore::INVALID_CID);
+  pool.release(cid);
+
+  CHECK(pool.checkout(ip, 80) == cid);
+  CHECK(pool.getStats().cold == 1);
+  CHECK(pool.getStats().warm == 1);
+}
+
+/*
+ * When the cid of an idle connection is reused for a new connection,
+ * even to the same destination, the pool must not hand it out, nor
+ * close it.
+ */
+static void test_cid_reused()
+{
+  SimModule sim;
+  GSModule gs;
+  CHECK(gs.begin(sim));
+  GSTcpPool pool(gs);
+
+  GSCore::cid_t cid = pool.checkout(ip, 80);
+  CHECK(cid != GSCore::INVALID_CID);
+  pool.release(cid);
+
+  // Someone else closes the connection and connects again, getting the
+  // same cid. The disconnect is never reported by the module.
+  CHECK(gs.disconnect(cid));
+  CHECK(gs.connectTcp(ip, 80) == cid);
+
+  size_t commands = sim.commands.size();
+  GSCore::cid_t other = pool.checkout(ip, 80);
+  CHECK(other != GSCore::INVALID_CID);
+  CHECK(other != cid);
+  CHECK(pool.getStats().warm == 0);
+  CHECK(gs.getConnectionInfo(cid).connected);
+
+  // Only the new connection was set up, the reused cid was not closed
+  CHECK(sim.commands.size() == commands + 1);
+  CHECK(sim.commands.back().compare(0, 9, "AT+NCTCP=") == 0);
+}
+
+int main()
+{
+  test_reuse();
+  test_cid_reused();
+  return report();
+}
+
+// vim: set sw=2 sts=2 expandtab:
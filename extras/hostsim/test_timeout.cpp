@@ -0,0 +1,98 @@
+/*
+ * Host-side simulator for the Gainspan Wifi2Serial library
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Tests for command replies that do not arrive in time. See
+ * SimModule.h for how to build and run this.
+ */
+
+#include <GSCore.h>
+#include "SimModule.h"
+#include "SimTest.h"
+
+static void setup(GSCore &gs, SimModule &sim)
+{
+  CHECK(gs.begin(sim));
+  gs.setTimeout(GSCore::GS_TIMEOUT_LOCAL, 100);
+}
+
+/* A late reply to a cheap command must not end up with the next one */
+static void test_late_reply()
+{
+  SimModule sim;
+  GSCore gs;
+  setup(gs, sim);
+
+  sim.slow_command = "AT+SLOW";
+  sim.slow_delay = 150000;
+  uint64_t start = sim_time;
+  CHECK(!gs.command("AT+SLOW").checkOk());
+  CHECK(sim_time - start < 1000000);
+  CHECK(!gs.unrecoverableError);
+
+  // The late "OK" must not be taken for the reply to this command
+  CHECK(!gs.command("BOGUS").checkOk());
+  CHECK(gs.command("AT").checkOk());
+  CHECK(!gs.unrecoverableError);
+}
+
+/* A reply that never arrives is not fatal for a cheap command */
+static void test_lost_reply()
+{
+  SimModule sim;
+  GSCore gs;
+  setup(gs, sim);
+
+  sim.slow_command = "AT+LOST";
+  uint8_t buf[16];
+  uint16_t len = sizeof(buf);
+  gs.command("AT+LOST").send();
+  CHECK(gs.readResponse(buf, &len) == GSCore::GS_RESPONSE_TIMEOUT);
+  CHECK(gs.command("AT").checkOk());
+  CHECK(!gs.unrecoverableError);
+}
+
+/* Other classes still treat a lost reply as fatal */
+static void test_lost_reply_fatal()
+{
+  SimModule sim;
+  GSCore gs;
+  setup(gs, sim);
+
+  sim.slow_command = "AT+LOST";
+  CHECK(!gs.command("AT+LOST", GSCore::GS_TIMEOUT_REMOTE).checkOk());
+  CHECK(gs.unrecoverableError);
+}
+
+int main()
+{
+  test_late_reply();
+  test_lost_reply();
+  test_lost_reply_fatal();
+  return report();
+}
+
+// vim: set sw=2 sts=2 expandtab:
@@ -0,0 +1,216 @@
+/*
+ * Host-side simulator for the Gainspan Wifi2Serial library
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Tests for pipelined data frames that are rejected by the module after
+ * their payload was already sent. See SimModule.h for how to build and
+ * run this.
+ */
+
+#include <GSCore.h>
+#include "SimModule.h"
+#include "SimTest.h"
+
+static uint32_t failed_offset;
+static unsigned failed_count;
+
+static void on_event(void *data, const GSCore::Event *event)
+{
+  GSCore &gs = *(GSCore*)data;
+  if (event->type == GSCore::GS_EVENT_WRITE_FAILURE) {
+    const GSCore::ConnectionInfo &info = gs.getCachedConnectionInfo(event->cid);
+    CHECK(info.tx_failed);
+    failed_offset = info.tx_failed_offset;
+    ++failed_count;
+  }
+}
+
+static bool write(GSCore &gs, GSCore::cid_t cid, const char *s)
+{
+  return gs.writeData(cid, (const uint8_t*)s, strlen(s));
+}
+
+static void setup(GSCore &gs, SimModule &sim)
+{
+  failed_offset = failed_count = 0;
+  CHECK(gs.begin(sim));
+  gs.onEvent = on_event;
+  gs.eventData = &gs;
+}
+
+/* A rejected pipelined frame must not break the next command */
+static void test_command_after_reject()
+{
+  SimModule sim;
+  GSCore gs;
+  setup(gs, sim);
+
+  gs.setTxPipelining(4);
+  sim.reject_frames = 1 << 1;
+  CHECK(write(gs, 1, "first frame"));
+  CHECK(write(gs, 1, "second frame"));
+  CHECK(write(gs, 1, "third frame"));
+
+  // The module replies to the garbage "0012second frame" command as
+  // well, which must not be taken for the reply to this command
+  CHECK(gs.writeCommandCheckOk("AT"));
+  CHECK(!gs.writeCommandCheckOk("BOGUS"));
+  CHECK(gs.writeCommandCheckOk("AT"));
+
+  CHECK(sim.received[1] == "first framethird frame");
+  CHECK(sim.commands.size() >= 4);
+  CHECK(sim.commands[sim.commands.size() - 4] == "0012second frame");
+  CHECK(gs.getConnectionInfo(1).error);
+
+  gs.loop();
+  CHECK(failed_count == 1);
+  CHECK(failed_offset == strlen("first frame"));
+  CHECK(!gs.unrecoverableError);
+}
+
+/*
+ * A payload containing line endings turns into multiple commands,
+ * which all get a reply. Pipelining must continue afterwards.
+ */
+static void test_multiline_payload()
+{
+  SimModule sim;
+  GSCore gs;
+  setup(gs, sim);
+
+  gs.setTxPipelining(4);
+  sim.reject_frames = 1 << 0;
+  CHECK(write(gs, 2, "line one\r\nAT+ANSWERED\r\nno newline"));
+  for (uint8_t i = 0; i < 8; ++i)
+    CHECK(write(gs, 2, "x"));
+  CHECK(gs.flushData());
+  CHECK(sim.received[2] == "xxxxxxxx");
+
+  CHECK(!gs.writeCommandCheckOk("BOGUS"));
+  CHECK(gs.writeCommandCheckOk("AT"));
+  CHECK(sim.commands.back() == "AT");
+  CHECK(!gs.unrecoverableError);
+}
+
+/* writeDataBatch must resync after a rejected frame and carry on */
+static void test_batch_reject()
+{
+  SimModule sim;
+  GSCore gs;
+  setup(gs, sim);
+
+  const char *data[] = {"zero", "one", "two\r\nAT", "three", "four"};
+  GSCore::TXFrame frames[5];
+  for (uint8_t i = 0; i < 5; ++i) {
+    frames[i].port = 0;
+    frames[i].buf = (const uint8_t*)data[i];
+    frames[i].length = strlen(data[i]);
+  }
+
+  sim.reject_frames = 1 << 2;
+  CHECK(gs.writeDataBatch(4, frames, 5) == 4);
+  CHECK(frames[0].ok && frames[1].ok && !frames[2].ok && frames[3].ok && frames[4].ok);
+  CHECK(sim.received[4] == "zeroonethreefour");
+
+  CHECK(!gs.writeCommandCheckOk("BOGUS"));
+  CHECK(gs.writeCommandCheckOk("AT"));
+  CHECK(!gs.unrecoverableError);
+}
+
+/* Frames queued by writeDataAsync are pipelined as well */
+static void test_async_reject()
+{
+  SimModule sim;
+  GSCore gs;
+  setup(gs, sim);
+
+  sim.reject_frames = 1 << 1;
+  const char *data[] = {"queued zero", "queued one", "queued two"};
+  for (const char *d : data)
+    CHECK(gs.writeDataAsync(5, (const uint8_t*)d, strlen(d)) == strlen(d));
+
+  CHECK(!gs.writeCommandCheckOk("BOGUS"));
+  CHECK(gs.writeCommandCheckOk("AT"));
+  CHECK(sim.received[5] == "queued zeroqueued two");
+  CHECK(gs.getConnectionInfo(5).error);
+
+  gs.loop();
+  CHECK(failed_count == 1);
+  CHECK(failed_offset == strlen("queued zero"));
+  CHECK(!gs.unrecoverableError);
+}
+
+/* A single cid cannot fill up the entire queue */
+static void test_async_cid_limit()
+{
+  SimModule sim;
+  GSCore gs;
+  setup(gs, sim);
+
+  // Make the module slow to reply, so frames stay queued
+  sim.reply_delay = 100000;
+  uint8_t buf[16] = {};
+  while (gs.writeDataAsync(6, buf, sizeof(buf)) == sizeof(buf))
+    /* nothing */;
+
+  CHECK(gs.availableForWrite(6) < sizeof(buf));
+  CHECK(gs.availableForWrite(7) >= sizeof(buf));
+  CHECK(gs.writeDataAsync(7, buf, sizeof(buf)) == sizeof(buf));
+
+  CHECK(gs.flushData());
+  CHECK(sim.received[7].size() == sizeof(buf));
+  CHECK(!gs.unrecoverableError);
+}
+
+/* Without pipelining, a rejected frame's payload is never sent */
+static void test_reject_without_pipelining()
+{
+  SimModule sim;
+  GSCore gs;
+  setup(gs, sim);
+
+  sim.reject_frames = 1 << 0;
+  CHECK(!write(gs, 3, "rejected"));
+  CHECK(write(gs, 3, "accepted"));
+  CHECK(gs.writeCommandCheckOk("AT"));
+  CHECK(sim.received[3] == "accepted");
+  CHECK(sim.commands.back() == "AT");
+  CHECK(!gs.unrecoverableError);
+}
+
+int main()
+{
+  test_command_after_reject();
+  test_multiline_payload();
+  test_batch_reject();
+  test_async_reject();
+  test_async_cid_limit();
+  test_reject_without_pipelining();
+
+  return report();
+}
+
+// vim: set sw=2 sts=2 expandtab:
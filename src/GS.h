@@ -1,4 +1,5 @@
 #include "GSModule/GSModule.h"
 #include "GSModule/GSTcpClient.h"
+#include "GSModule/GSTcpPool.h"
 #include "GSModule/GSUdpClient.h"
 #include "GSModule/GSUdpServer.h"
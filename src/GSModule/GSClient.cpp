@@ -34,13 +34,118 @@ size_t GSClient::write(uint8_t c)
 
 size_t GSClient::write(const uint8_t *buf, size_t size)
 {
-  if (!gs.writeData(this->cid, buf, size))
+  // Make room for the new data (or keep the data in order when
+  // bypassing the buffer below)
+  if (this->no_delay || this->tx_len + size > TX_BUFFER_SIZE) {
+    if (!sendBuffer())
+      return 0;
+  }
+
+  // Big writes that would not benefit from buffering go out directly
+  if (this->no_delay || size >= TX_BUFFER_SIZE) {
+    if (!sendData(buf, size))
+      return 0;
+    return size;
+  }
+
+  if (!this->tx_len) {
+    this->tx_start = millis();
+    gs.addLoopHandler(this);
+  }
+  memcpy(this->tx_buf + this->tx_len, buf, size);
+  this->tx_len += size;
+
+  if (this->tx_len == TX_BUFFER_SIZE && !sendBuffer())
+    return 0;
+  return size;
+}
+
+void GSClient::setNoDelay(bool no_delay)
+{
+  this->no_delay = no_delay;
+  if (no_delay)
+    sendBuffer();
+}
+
+bool GSClient::writeStream(uint32_t len, GSCore::data_producer_t producer, void *data)
+{
+  return sendBuffer() && gs.writeStream(this->cid, len, producer, data);
+}
+
+bool GSClient::writeStream(uint32_t len, Stream &stream)
+{
+  return sendBuffer() && gs.writeStream(this->cid, len, stream);
+}
+
+size_t GSClient::write_P(const uint8_t *buf, size_t size)
+{
+  // Small writes can go through the transmit buffer as usual
+  if (!this->no_delay && size < TX_BUFFER_SIZE) {
+    uint8_t tmp[TX_BUFFER_SIZE];
+    memcpy_P(tmp, buf, size);
+    return write(tmp, size);
+  }
+
+  if (!sendBuffer() || !gs.writeData_P(this->cid, buf, size))
     return 0;
   return size;
 }
 
+int GSClient::availableForWrite()
+{
+  uint16_t queue = gs.availableForWrite(this->cid);
+  if (this->no_delay)
+    return queue;
+
+  // Filling up the transmit buffer sends it, which only happens without
+  // blocking when it can be queued.
+  int room = TX_BUFFER_SIZE - this->tx_len;
+  if (queue < TX_BUFFER_SIZE)
+    room--;
+  return room;
+}
+
+bool GSClient::sendData(const uint8_t *buf, size_t size)
+{
+  // Queue the data when possible, so we don't have to wait for the
+  // module to accept it.
+  if (size <= gs.availableForWrite(this->cid))
+    return gs.writeDataAsync(this->cid, buf, size) == size;
+  return gs.writeData(this->cid, buf, size);
+}
+
+bool GSClient::sendBuffer()
+{
+  if (!this->tx_len)
+    return true;
+
+  bool ok = sendData(this->tx_buf, this->tx_len);
+  // On failure, the data is dropped anyway, since retrying is unlikely
+  // to help.
+  this->tx_len = 0;
+  gs.removeLoopHandler(this);
+  return ok;
+}
+
+void GSClient::loop()
+{
+  // Don't block when the buffer cannot be queued yet, just try again
+  // on the next loop.
+  if (this->tx_len && (unsigned long)(millis() - this->tx_start) >= this->write_delay
+      && this->tx_len <= gs.availableForWrite(this->cid))
+    sendBuffer();
+}
+
+GSClient::~GSClient()
+{
+  sendBuffer();
+}
+
 int GSClient::available()
 {
+  // Callers are likely waiting for a reply to data they wrote, so make
+  // sure it does not linger in the buffer.
+  loop();
   return gs.availableData(this->cid);
 }
 
@@ -61,11 +166,14 @@ int GSClient::peek()
 
 void GSClient::flush()
 {
-  // Nothing todo, we don't keep any buffers
+  sendBuffer();
+  gs.flushData();
 }
 
 void GSClient::stop()
 {
+  // Make sure queued data is sent before closing the connection
+  flush();
   gs.disconnect(this->cid);
 }
 
@@ -73,7 +181,10 @@ uint8_t GSClient::connected()
 {
   if (this->cid == GSModule::INVALID_CID)
     return false;
-  return gs.getConnectionInfo(this->cid).connected;
+  // This is often called in a tight loop, so don't read from the
+  // module on every call
+  gs.refreshState();
+  return gs.getCachedConnectionInfo(this->cid).connected;
 }
 
 GSClient::operator bool()
@@ -83,6 +194,7 @@ GSClient::operator bool()
 
 GSClient& GSClient::operator =(GSCore::cid_t cid)
 {
+  sendBuffer();
   this->cid = cid;
   return *this;
 }
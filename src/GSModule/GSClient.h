@@ -32,9 +32,10 @@
 
 #include "GSModule.h"
 
-class GSClient : public Client {
+class GSClient : public Client, protected GSCore::LoopHandler {
   public:
     GSClient(GSModule &gs) : gs(gs), cid(GSModule::INVALID_CID) { } ;
+    ~GSClient();
 
     /****************************************************************
      * Stuff from Client / Stream / Print
@@ -46,6 +47,7 @@ class GSClient : public Client {
     virtual int read(uint8_t *buf, size_t size);
     virtual int peek();
     virtual void flush();
+    virtual int availableForWrite();
     virtual void stop();
     virtual uint8_t connected();
     virtual operator bool();
@@ -54,10 +56,85 @@ class GSClient : public Client {
     // Include other overloads of write
     using Print::write;
 
+    /****************************************************************
+     * Gainspan-specific stuff
+     ****************************************************************/
+
+    /**
+     * Small writes are collected in a buffer of this size, so they can
+     * be sent in a single bulk data frame.
+     */
+    static const uint8_t TX_BUFFER_SIZE = 64;
+
+    /** The default for setWriteDelay, in milliseconds */
+    static const uint16_t DEFAULT_WRITE_DELAY = 10;
+
+    /**
+     * Set how long written data can stay in the transmit buffer before
+     * it is sent. The buffer is also sent when it is full, when flush()
+     * or stop() is called, or when no more room is available. The delay
+     * is checked from GSModule::loop(), so that must be called
+     * regularly.
+     *
+     * @param ms    The maximum delay, in milliseconds.
+     */
+    void setWriteDelay(uint16_t ms) { this->write_delay = ms; }
+
+    /**
+     * Disable (or re-enable) the transmit buffer. When enabled, each
+     * call to write() results in a bulk data frame being sent right
+     * away, which reduces latency but is a lot less efficient for small
+     * writes (such as those done by print()).
+     */
+    void setNoDelay(bool no_delay);
+
+    /**
+     * Send len bytes supplied by a producer callback, without needing
+     * all of them in RAM. See GSCore::writeStream.
+     */
+    bool writeStream(uint32_t len, GSCore::data_producer_t producer, void *data);
+
+    /**
+     * Send len bytes read from the given stream (e.g., a file on an SD
+     * card). See GSCore::writeStream.
+     */
+    bool writeStream(uint32_t len, Stream &stream);
+
+    /**
+     * Write data stored in program memory (PROGMEM), without copying
+     * all of it to RAM first.
+     */
+    size_t write_P(const uint8_t *buf, size_t size);
+
   protected:
+    /**
+     * Send data directly, bypassing the transmit buffer. The data is
+     * queued when there is room, and written synchronously otherwise.
+     */
+    bool sendData(const uint8_t *buf, size_t size);
+
+    /**
+     * Send any data in the transmit buffer.
+     *
+     * @returns true when the data was sent (or there was none), false
+     *          otherwise.
+     */
+    bool sendBuffer();
+
+    /** Called by GSModule::loop() while data is buffered */
+    virtual void loop();
+
     GSModule &gs;
     GSModule::cid_t cid;
 
+    /** Data written but not sent yet */
+    uint8_t tx_buf[TX_BUFFER_SIZE];
+    uint8_t tx_len = 0;
+    /** millis() when the first byte was put into tx_buf */
+    unsigned long tx_start;
+    uint16_t write_delay = DEFAULT_WRITE_DELAY;
+    bool no_delay = false;
+
 };
 
 #endif // _GS_CLIENT_H
@@ -65,8 +65,17 @@ GSCore::GSCore()
   // definition) is divisible by the buffer size, which is needed to
   // guarantee proper negative wraparound.
   static_assert( is_power_of_two(sizeof(rx_data)), "rx_data size is not a power of two" );
+  static_assert( sizeof(tx_replies) * 8 >= MAX_TX_PENDING, "tx_replies is too small for MAX_TX_PENDING" );
+  static_assert( is_power_of_two(MAX_TX_PENDING), "MAX_TX_PENDING is not a power of two" );
+  static_assert( max_for_type(__typeof__(event_queue_len)) >= EVENT_QUEUE_SIZE, "event_queue_len is too small for EVENT_QUEUE_SIZE" );
+  static_assert( sizeof(data_events) * 8 > MAX_CID, "data_events is too small for MAX_CID" );
+  static_assert( sizeof(disconnected_cids) * 8 > MAX_CID, "disconnected_cids is too small for MAX_CID" );
+  static_assert( EVENT_QUEUE_SIZE > 0, "EVENT_QUEUE_SIZE must be at least 1" );
+  static_assert( TX_QUEUE_SIZE > TX_QUEUE_FRAME_OVERHEAD, "TX_QUEUE_SIZE leaves no room for data" );
+  static_assert( is_power_of_two(MAX_BATCH_PENDING), "MAX_BATCH_PENDING is not a power of two" );
   this->debug = NULL;
   this->error = NULL;
+  this->batch.active = false;
 }
 
 bool GSCore::begin(Stream &serial)
@@ -101,74 +110,270 @@ bool GSCore::begin(uint8_t ss, uint8_t data_ready, SPISettings settings)
 
 bool GSCore::_begin()
 {
+  this->boot_count++;
   this->rx_state = GS_RX_IDLE;
+  this->response.active = false;
+  // A command still waiting for its reply will never get it now
+  AsyncCommand *cmd = this->async_command;
+  this->async_command = NULL;
+  if (cmd) {
+    cmd->pending = false;
+    cmd->response = GS_UNRECOVERABLE_ERROR;
+    if (cmd->onComplete)
+      cmd->onComplete(cmd->data, cmd);
+  }
+  this->batch.active = false;
+  this->command_timeout_class = GS_TIMEOUT_OTHER;
   this->rx_data_head = this->rx_data_tail = 0;
   this->tail_frame.length = 0;
   this->spi_prev_was_esc = false;
   this->spi_xoff = false;
   this->ncm_auto_cid = INVALID_CID;
-  this->events = 0;
+  this->event_queue_head = this->event_queue_len = 0;
+  this->events_lost = 0;
+  this->data_events = 0;
+  this->tx_pending_head = this->tx_unacked = 0;
+  this->tx_resync = false;
+  this->lost_reply_timeout = 0;
+  this->tx_replies = this->tx_replies_len = 0;
+  this->tx_queue_head = this->tx_queue_tail = 0;
+  this->tx_queue_len = this->tx_queue_sent = 0;
   this->spi_poll_time = micros() - MINIMUM_POLL_INTERVAL;
 
-  // TODO: Query AT+NSTAT=? to see if we are aready connected (in case
-  // the NCM already connected before we were initialized).
   this->associated = false;
+  memset(this->connections, 0, sizeof(connections));
+  this->disconnected_cids = 0;
+
+  // When warm starting, see if the module is already running. If it
+  // sent anything but a proper reply, it was probably just booting and
+  // printing its startup banner.
+  bool seen_data = false;
+  bool running = this->warm_start && probeModule(&seen_data);
+  if (!running) {
+    // The probe might have failed to write to a module that was not
+    // ready yet, which is not a problem.
+    this->unrecoverableError = false;
+
+    // The startup procedure is:
+    //  - Wait for the data_ready pin to go high
+    //  - Read the startup banner
+    uint32_t start = millis();
+    while (!seen_data) {
+      if (this->data_ready_pin != INVALID_PIN) {
+        // Check the data_ready pin.
+        if (digitalRead(this->data_ready_pin) == HIGH)
+          break;
+      } else {
+        // If we do not have access to the pin, we just poll the SPI port
+        // instead. Note that after a reset, the module seems to send a
+        // bunch of 0xff and one 0x80 character, which we should ignore
+        // here as well.
+        int c = readRaw();
+        if (c != -1 && c != 0x80)
+          break;
+        if (this->unrecoverableError)
+          return false;
+      }
 
-  // The startup procedure is:
-  //  - Wait for the data_ready pin to go high
-  //  - Read the startup banner
-  uint32_t start = millis();
-  do {
-    if (this->data_ready_pin != INVALID_PIN) {
-      // Check the data_ready pin.
-      if (digitalRead(this->data_ready_pin) == HIGH)
-        break;
-    } else {
-      // If we do not have access to the pin, we just poll the SPI port
-      // instead. Note that after a reset, the module seems to send a
-      // bunch of 0xff and one 0x80 character, which we should ignore
-      // here as well.
-      int c = readRaw();
-      if (c != -1 && c != 0x80)
-        break;
-      if (this->unrecoverableError)
+      if ((unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
+        if (GS_LOG_ERRORS && this->error)
+          this->error->println(F("Startup banner timeout"));
         return false;
+      }
     }
 
-    if ((unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
-      if (GS_LOG_ERRORS && this->error)
-        this->error->println(F("Startup banner timeout"));
-      return false;
-    }
-  } while (true);
-
-  // When we get here, some data is available. We just clear out all of
-  // it (since checking the banner is tricky, there's a few different
-  // things that could be printed).
-  while(readRaw() != -1) /* nothing */;
+    // When we get here, some data is available. We just clear out all of
+    // it (since checking the banner is tricky, there's a few different
+    // things that could be printed).
+    while(readRaw() != -1) /* nothing */;
+  }
 
   // Always start with disabling verbose mode, otherwise we won't be
   // able to interpret responses
-  if (!writeCommandCheckOk("ATV0"))
+  if (!command(F("ATV0")).checkOk())
     return false;
 
+  // The remaining commands don't depend on each other, so send them
+  // back to back
+  beginBatch(NULL, 3);
+
   // Disable echo mode
-  if (!writeCommandCheckOk("ATE0"))
-    return false;
+  command(F("ATE0")).checkOk();
 
   // Enable bulk mode
-  if (!writeCommandCheckOk("AT+BDATA=1"))
-    return false;
+  command(F("AT+BDATA=1")).checkOk();
 
   // Enable enhanced asynchronous messages
-  if (!writeCommandCheckOk("AT+ASYNCMSGFMT=1"))
+  command(F("AT+ASYNCMSGFMT=1")).checkOk();
+
+  if (!endBatch())
     return false;
 
-  memset(this->connections, 0, sizeof(connections));
+  // If the module was already running, it might still be associated
+  // and have connections open
+  if (running && !resyncState())
+    return false;
 
   return true;
 }
 
+bool GSCore::probeModule(bool *seen_data)
+{
+  // Drop anything left over from before we were reset
+  while(readRaw() != -1)
+    *seen_data = true;
+
+  // This is the first command sent anyway, so it does not hurt
+  command(F("ATV0")).send();
+
+  // Don't use readResponse, since that considers a timeout fatal
+  startResponse(this->async_response_buf, sizeof(this->async_response_buf), NULL, false, NULL, NULL);
+  unsigned long start = millis();
+  while (!this->response.done) {
+    int c = readRaw();
+    if (c != -1) {
+      *seen_data = true;
+      processIncoming(c);
+    } else if (this->unrecoverableError || (unsigned long)(millis() - start) > WARM_START_TIMEOUT) {
+      this->response.active = false;
+      return false;
+    }
+  }
+
+  return this->response.result == GS_SUCCESS;
+}
+
+bool GSCore::resyncState()
+{
+  // The module might still be busy with whatever it was doing, so
+  // don't assume these are fast
+  command(F("AT+NSTAT=?"), GS_TIMEOUT_OTHER).send();
+  if (readResponse(processStatusLine, this) != GS_SUCCESS)
+    return false;
+
+  if (!this->associated)
+    return true;
+
+  CidListState state = {this, INVALID_CID, 0};
+  command(F("AT+CID=?"), GS_TIMEOUT_OTHER).send();
+  GSResponse res = readResponse(processCidLine, &state);
+
+  // If the NCM sets up a connection and there is just one client
+  // connection, assume it was set up by the NCM. Without the NCM, this
+  // is just a connection the application forgot about.
+  if (this->ncm_connect && state.clients == 1)
+    this->ncm_auto_cid = state.client;
+
+  return res == GS_SUCCESS;
+}
+
+void GSCore::processStatusLine(const uint8_t *buf, uint16_t len, void *data)
+{
+  parseStatusLine(buf, len, processStatusField, data);
+}
+
+void GSCore::processStatusField(const uint8_t *key, uint16_t key_len, const uint8_t *value, uint16_t value_len, void *data)
+{
+  GSCore *gs = (GSCore*)data;
+  const char connected[] = "CONNECTED";
+  if (statusKeyMatches(key, key_len, "WSTATE") && value_len == sizeof(connected) - 1 && !memcmp(value, connected, value_len))
+    gs->associated = true;
+}
+
+void GSCore::parseStatusLine(const uint8_t *buf, uint16_t len, status_field_callback_t callback, void *data)
+{
+  // Lines contain one or more key=value fields, e.g.:
+  //   WSTATE=CONNECTED     MODE=INFRA
+  //   BSSID=00:24:01:00:00:00   SSID="My net"   CHANNEL=1   SECURITY=WPA2-PERSONAL
+  //   IP addr=192.168.1.103   SubNet=255.255.255.0  Gateway=192.168.1.1
+  // Keys can contain spaces and values end at the first space, except
+  // for quoted values. Some values also contain spaces (e.g.
+  // WSTATE=NOT CONNECTED), so the rest of those ends up in the next
+  // key, which is why keys are matched on their last word(s) (see
+  // statusKeyMatches).
+  const uint8_t *end = buf + len;
+  const uint8_t *p = buf;
+  while (p < end) {
+    const uint8_t *key = p;
+    const uint8_t *eq = (const uint8_t*)memchr(p, '=', end - p);
+    if (!eq)
+      return;
+
+    const uint8_t *value = eq + 1;
+    const uint8_t *value_end;
+    if (value < end && *value == '"') {
+      // Quoted value, ends at a quote followed by a space or the end of
+      // the line (the value itself might contain quotes)
+      ++value;
+      value_end = value;
+      while (value_end < end && !(*value_end == '"' && (value_end + 1 == end || value_end[1] == ' ')))
+        ++value_end;
+      p = value_end + 1;
+    } else {
+      value_end = value;
+      while (value_end < end && *value_end != ' ')
+        ++value_end;
+      p = value_end;
+    }
+
+    callback(key, eq - key, value, value_end - value, data);
+
+    while (p < end && *p == ' ')
+      ++p;
+  }
+}
+
+bool GSCore::statusKeyMatches(const uint8_t *key, uint16_t len, const char *name)
+{
+  uint16_t name_len = strlen(name);
+  if (len < name_len || memcmp(key + len - name_len, name, name_len))
+    return false;
+  return len == name_len || key[len - name_len - 1] == ' ';
+}
+
+void GSCore::processCidLine(const uint8_t *buf, uint16_t len, void *data)
+{
+  CidListState *state = (CidListState*)data;
+
+  // Lines look like "0 TCP CLIENT 1234 80 192.168.1.1", preceded by a
+  // header line (or just "No valid Cids"). Split on spaces.
+  const uint8_t NUM_FIELDS = 6;
+  const uint8_t *fields[NUM_FIELDS];
+  uint8_t lens[NUM_FIELDS];
+  uint8_t n = 0;
+  uint16_t i = 0;
+  while (n < NUM_FIELDS) {
+    while (i < len && buf[i] == ' ')
+      ++i;
+    if (i == len)
+      break;
+    fields[n] = buf + i;
+    while (i < len && buf[i] != ' ')
+      ++i;
+    lens[n] = buf + i - fields[n];
+    ++n;
+  }
+
+  cid_t cid;
+  uint16_t local_port, remote_port;
+  IPAddress ip;
+  if (n != NUM_FIELDS || lens[0] != 1)
+    return;
+  if (!parseNumber(&cid, fields[0], 1, 16) || cid > MAX_CID)
+    return;
+  if (!parseNumber(&local_port, fields[3], lens[3], 10) || !parseNumber(&remote_port, fields[4], lens[4], 10))
+    return;
+  if (!parseIpAddress(&ip, (const char*)fields[5], lens[5]))
+    return;
+
+  state->gs->processConnect(cid, ip, remote_port, local_port, false);
+
+  if (lens[2] == 6 && !memcmp(fields[2], "CLIENT", 6)) {
+    state->client = cid;
+    state->clients++;
+  }
+}
+
 
 void GSCore::end()
 {
@@ -180,33 +385,94 @@ void GSCore::end()
 
   // Make sure that queries on state still return something sane
   memset(this->connections, 0, sizeof(connections));
+  this->disconnected_cids = 0;
   this->associated = false;
   unrecoverableError = false;
 }
 
+/**
+ * Returns true when budget_us is 0 (no limit), or when less than
+ * budget_us microseconds have passed since start.
+ */
+static bool budget_left(unsigned long start, uint32_t budget_us)
+{
+  return !budget_us || (unsigned long)(micros() - start) < budget_us;
+}
+
 void GSCore::loop()
 {
-  if (this->unrecoverableError)
+  loop(0);
+}
+
+bool GSCore::loop(uint32_t budget_us, LoopStats *stats)
+{
+  LoopStats s = LoopStats();
+  unsigned long start = micros();
+
+  // Replies to batched commands must not be processed as async data
+  waitBatchReplies();
+
+  if (!this->unrecoverableError) {
+    bool more;
+    s.bytes_processed = readAndProcessAsync(start, budget_us, &more);
+    s.rx_pending = more;
+
+    // Completing an async command might send a followup command, so
+    // only do so when there is budget left
+    if (budget_left(start, budget_us))
+      processAsyncCommand();
+    else if (this->async_command && this->response.done)
+      s.async_pending = true;
+
+    if (budget_left(start, budget_us))
+      drainTxQueue(false);
+    else if (this->tx_queue_len)
+      s.tx_skipped = true;
+
+    s.events_dispatched = dispatchEvents(start, budget_us);
+
+    if (budget_left(start, budget_us)) {
+      LoopHandler *handler = this->loop_handlers;
+      while (handler) {
+        // Handlers might remove themselves, so find the next one first
+        LoopHandler *next = handler->next_handler;
+        handler->loop();
+        handler = next;
+      }
+    } else if (this->loop_handlers) {
+      s.handlers_pending = true;
+    }
+  }
+
+  s.events_pending = this->event_queue_len;
+  s.tx_pending = this->tx_queue_len;
+  if (stats)
+    *stats = s;
+
+  return !s.rx_pending && !s.async_pending && !s.handlers_pending && !s.events_pending && !s.tx_pending;
+}
+
+void GSCore::addLoopHandler(LoopHandler *handler)
+{
+  if (handler->registered)
     return;
 
-  readAndProcessAsync();
+  handler->next_handler = this->loop_handlers;
+  handler->registered = true;
+  this->loop_handlers = handler;
+}
 
-  if (this->onNcmDisconnect && (this->events & EVENT_NCM_DISCONNECTED)) {
-    this->events &= ~EVENT_NCM_DISCONNECTED;
-    this->onNcmDisconnect(this->eventData);
-  }
-  if (this->onDisassociate && (this->events & EVENT_DISASSOCIATED)) {
-    this->events &= ~EVENT_DISASSOCIATED;
-    this->onDisassociate(this->eventData);
-  }
-  if (this->onAssociate && (this->events & EVENT_ASSOCIATED)) {
-    this->events &= ~EVENT_ASSOCIATED;
-    this->onAssociate(this->eventData);
-  }
-  if (this->onNcmConnect && (this->events & EVENT_NCM_CONNECTED)) {
-    this->events &= ~EVENT_NCM_CONNECTED;
-    this->onNcmConnect(this->eventData, this->ncm_auto_cid);
-  }
+void GSCore::removeLoopHandler(LoopHandler *handler)
+{
+  if (!handler->registered)
+    return;
+
+  LoopHandler **p = &this->loop_handlers;
+  while (*p && *p != handler)
+    p = &(*p)->next_handler;
+  if (*p)
+    *p = handler->next_handler;
+  handler->registered = false;
 }
 
 /*******************************************************
@@ -304,6 +570,70 @@ GSCore::cid_t GSCore::firstCidWithData()
   return this->tail_frame.cid;
 }
 
+uint16_t GSCore::cidsWithData()
+{
+  // This loads the next frame header into tail_frame when needed
+  if (firstCidWithData() == INVALID_CID)
+    return 0;
+
+  uint16_t mask = 1 << this->tail_frame.cid;
+
+  // Walk the frame headers buffered behind the data of tail_frame
+  rx_data_index_t pos = this->rx_data_tail;
+  uint16_t remaining = this->tail_frame.length;
+  while (true) {
+    uint16_t buffered = (this->rx_data_head - pos) % sizeof(this->rx_data);
+    if (remaining >= buffered)
+      return mask;
+
+    pos = (pos + remaining) % sizeof(this->rx_data);
+
+    RXFrame frame;
+    loadFrameHeader(&frame, &pos);
+    remaining = frame.length;
+
+    if (frame.cid <= MAX_CID)
+      mask |= 1 << frame.cid;
+  }
+}
+
+bool GSCore::poll(uint16_t *readable, uint16_t *writable, uint16_t timeout_ms)
+{
+  uint16_t want_read = readable ? *readable : 0;
+  uint16_t want_write = writable ? *writable : 0;
+  uint16_t ready_read, ready_write;
+  unsigned long start = millis();
+
+  while (true) {
+    loop();
+
+    // A connected cid is writable when it can queue data, which is
+    // limited per cid (see availableForWrite)
+    ready_write = 0;
+    for (cid_t cid = 0; cid <= MAX_CID; ++cid) {
+      uint16_t mask = 1 << cid;
+      if ((want_write & mask) && this->connections[cid].connected && availableForWrite(cid))
+        ready_write |= mask;
+    }
+
+    // Cids that were never connected (e.g. a connectAsync() that is
+    // still pending) are not readable, only ones that went down
+    ready_read = want_read & (cidsWithData() | this->disconnected_cids);
+
+    if (ready_read || ready_write || this->unrecoverableError)
+      break;
+
+    if ((unsigned long)(millis() - start) >= timeout_ms)
+      break;
+  }
+
+  if (readable)
+    *readable = ready_read;
+  if (writable)
+    *writable = ready_write;
+  return ready_read || ready_write;
+}
+
 uint16_t GSCore::availableData(cid_t cid)
 {
   if (!getFrameHeader(cid))
@@ -324,8 +654,10 @@ uint16_t GSCore::availableData(cid_t cid)
   // available() returns > 0. So we should only return 0 when really is
   // no data available. For this reason, if our buffer is empty, try to
   // read at least one byte from the module.
-  if (this->rx_data_head == this->rx_data_tail)
+  if (this->rx_data_head == this->rx_data_tail) {
+    waitBatchReplies();
     processIncoming(readRaw());
+  }
 
   uint16_t len = (this->rx_data_head - this->rx_data_tail) % sizeof(this->rx_data);
   if (len > this->tail_frame.length)
@@ -338,11 +670,94 @@ bool GSCore::writeData(cid_t cid, const uint8_t *buf, uint16_t len)
   if (cid > MAX_CID)
     return false;
 
-  // Hardware doesn't support more than 1400, according to SERIAL-TO-WIFI ADAPTER
-  // APPLICATION PROGRAMMING GUIDE, section 3.4.1 ("Bulk data Tx and Rx")
-  if (len > 1400)
-    return writeData(cid, buf, 1400) && writeData(cid, buf + 1400, len - 1400);
+  // Split frames that are too big for the hardware
+  if (len > MAX_DATA_FRAME_SIZE)
+    return writeData(cid, buf, MAX_DATA_FRAME_SIZE) && writeData(cid, buf + MAX_DATA_FRAME_SIZE, len - MAX_DATA_FRAME_SIZE);
+
+  if (!beginDataFrame(cid, len))
+    return false;
+
+  if (writeRaw(buf, len) != len) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("Writing bulk data frame timed out");
+    return false;
+  }
+  return true;
+}
+
+static uint16_t stream_producer(uint8_t *buf, uint16_t len, void *data)
+{
+  return ((Stream*)data)->readBytes((char*)buf, len);
+}
+
+bool GSCore::writeStream(cid_t cid, uint32_t len, Stream &stream)
+{
+  return writeStream(cid, len, stream_producer, &stream);
+}
+
+static uint16_t progmem_producer(uint8_t *buf, uint16_t len, void *data)
+{
+  const uint8_t **p = (const uint8_t**)data;
+  memcpy_P(buf, *p, len);
+  *p += len;
+  return len;
+}
+
+bool GSCore::writeData_P(cid_t cid, const uint8_t *buf, uint32_t len)
+{
+  return writeStream(cid, len, progmem_producer, &buf);
+}
+
+bool GSCore::writeStream(cid_t cid, uint32_t len, data_producer_t producer, void *data)
+{
+  if (cid > MAX_CID)
+    return false;
+
+  bool ok = true;
+  while (len) {
+    uint16_t frame_len = MAX_DATA_FRAME_SIZE;
+    if (len < frame_len)
+      frame_len = len;
+
+    if (!beginDataFrame(cid, frame_len))
+      return false;
+    len -= frame_len;
+
+    while (frame_len) {
+      uint8_t buf[STREAM_CHUNK_SIZE];
+      uint16_t chunk = sizeof(buf);
+      if (frame_len < chunk)
+        chunk = frame_len;
+
+      uint16_t read = ok ? producer(buf, chunk, data) : 0;
+      if (read > chunk)
+        read = chunk;
+
+      if (!read) {
+        // The module expects the rest of the frame, so pad it to keep
+        // in sync, but don't start another frame after this one.
+        if (ok && GS_LOG_ERRORS && this->error)
+          this->error->println("Data producer ran out, padding frame");
+        ok = false;
+        memset(buf, 0, chunk);
+        read = chunk;
+      }
+      if (writeRaw(buf, read) != read) {
+        if (GS_LOG_ERRORS && this->error)
+          this->error->println("Writing bulk data frame timed out");
+        return false;
+      }
+      frame_len -= read;
+    }
+
+    if (!ok)
+      return false;
+  }
+  return true;
+}
 
+bool GSCore::beginDataFrame(cid_t cid, uint16_t len)
+{
   if (GS_DUMP_LINES && this->debug) {
     this->debug->print(">>| Writing bulk data frame for cid ");
     this->debug->print(cid);
@@ -351,239 +766,929 @@ bool GSCore::writeData(cid_t cid, const uint8_t *buf, uint16_t len)
     this->debug->println(" bytes");
   }
 
-  uint8_t header[8]; // Including a trailing 0 that snprintf insists to write
-  // TODO: Also support UDP server
-  snprintf((char*)header, sizeof(header), "\x1bZ%x%04d", cid, len);
+  uint8_t header[MAX_FRAME_HEADER_SIZE];
+  uint8_t headerlen = formatFrameHeader(header, cid, NULL, 0, len);
+
+  // Keep data queued by writeDataAsync in order
+  if (!drainTxQueue(true))
+    return false;
+
+  // After a pipelined frame was rejected, the module must be back in
+  // sync before pipelining again
+  if (this->tx_resync && !resyncTx())
+    return false;
+
+  if (this->tx_pipeline_depth && !commandReplyPending()) {
+    // Make sure there is room for another pending frame, then write
+    // the entire header without waiting for the reply.
+    if (!waitTxPending(this->tx_pipeline_depth - 1))
+      return false;
+    addTxPending(cid, TX_PENDING_DEFERRED | TX_PENDING_EARLY, len);
+    return writeRaw(header, headerlen) == headerlen;
+  }
+
   // First, write the escape sequence up to the cid. After this, the
   // module responds with <ESC>O or <ESC>F.
-  writeRaw(header, 3);
-  if (!readDataResponse()) {
+  if (!waitTxPending(MAX_TX_PENDING - 1))
+    return false;
+  addTxPending(cid, 0, len);
+  if (writeRaw(header, 3) != 3 || !readDataResponse()) {
     if (GS_LOG_ERRORS && this->error)
       this->error->println("Sending bulk data frame failed");
     return false;
   }
 
-  // Then, write the rest of the escape sequence (-1 to not write the
-  // trailing 0)
-  writeRaw(header + 3, sizeof(header) - 1 - 3);
-  // And write the actual data
-  writeRaw(buf, len);
+  // Then, write the rest of the escape sequence
+  return writeRaw(header + 3, headerlen - 3) == headerlen - 3;
+}
+
+uint16_t GSCore::writeDataAsync(cid_t cid, const uint8_t *buf, uint16_t len)
+{
+  if (cid > MAX_CID || !len || len > availableForWrite(cid))
+    return 0;
+
+  uint8_t frame[TX_QUEUE_FRAME_OVERHEAD] = {cid, (uint8_t)len, (uint8_t)(len >> 8)};
+  for (uint8_t i = 0; i < sizeof(frame); ++i) {
+    this->tx_queue[this->tx_queue_head] = frame[i];
+    this->tx_queue_head = (this->tx_queue_head + 1) % TX_QUEUE_SIZE;
+  }
+
+  // Copy the data in (at most) two parts, in case it wraps around
+  uint16_t first = TX_QUEUE_SIZE - this->tx_queue_head;
+  if (first > len)
+    first = len;
+  memcpy(this->tx_queue + this->tx_queue_head, buf, first);
+  memcpy(this->tx_queue, buf + first, len - first);
+  this->tx_queue_head = (this->tx_queue_head + len) % TX_QUEUE_SIZE;
+  this->tx_queue_len += sizeof(frame) + len;
+  this->connections[cid].tx_accepted += len;
+
+  // Start sending right away, as far as possible without blocking
+  drainTxQueue(false);
+  return len;
+}
+
+uint16_t GSCore::availableForWrite()
+{
+  uint16_t room = TX_QUEUE_SIZE - this->tx_queue_len;
+  if (room <= TX_QUEUE_FRAME_OVERHEAD)
+    return 0;
+  room -= TX_QUEUE_FRAME_OVERHEAD;
+  if (room > MAX_DATA_FRAME_SIZE)
+    room = MAX_DATA_FRAME_SIZE;
+  return room;
+}
+
+uint16_t GSCore::availableForWrite(cid_t cid)
+{
+  if (cid > MAX_CID)
+    return 0;
+
+  // Limit the share of a single cid, so a cid with a lot of data
+  // queued does not keep the others from queueing
+  const ConnectionInfo& info = this->connections[cid];
+  uint32_t queued = info.tx_accepted - info.tx_completed;
+  if (queued >= TX_QUEUE_CID_LIMIT)
+    return 0;
+
+  uint16_t room = availableForWrite();
+  if (room > TX_QUEUE_CID_LIMIT - queued)
+    room = TX_QUEUE_CID_LIMIT - queued;
+  return room;
+}
+
+bool GSCore::drainTxQueue(bool block)
+{
+  while (this->tx_queue_len) {
+    if (this->unrecoverableError)
+      return false;
+
+    cid_t cid = peekTxQueue(0);
+    uint16_t len = peekTxQueue(1) | (peekTxQueue(2) << 8);
+    uint8_t header[MAX_FRAME_HEADER_SIZE];
+    uint8_t headerlen = formatFrameHeader(header, cid, NULL, 0, len);
+
+    if (!this->tx_queue_sent) {
+      // Starting a new frame. After a rejected frame, the module must
+      // be back in sync first. This blocks even when block is false,
+      // but only happens after a frame was rejected.
+      if (this->tx_resync && !resyncTx())
+        return false;
+
+      // Make sure there is room for another pending reply.
+      if (this->tx_unacked >= MAX_TX_PENDING && (!block || !waitTxPending(MAX_TX_PENDING - 1)))
+        return false;
+
+      // While a command reply is due, the payload can only be sent
+      // once the module accepted the frame (see commandReplyPending)
+      bool early = !commandReplyPending();
+      if (!early && !block)
+        return false;
+
+      if (GS_DUMP_LINES && this->debug) {
+        this->debug->print(">>| Writing queued bulk data frame for cid ");
+        this->debug->print(cid);
+        this->debug->print(" containing ");
+        this->debug->print(len);
+        this->debug->println(" bytes");
+      }
+
+      if (early) {
+        addTxPending(cid, TX_PENDING_DEFERRED | TX_PENDING_EARLY, len);
+      } else {
+        // Write the escape sequence up to the cid and wait for the
+        // reply, like writeData does without pipelining
+        uint32_t offset = this->connections[cid].tx_offset;
+        addTxPending(cid, 0, len);
+        if (writeRawInternal(header, 3, true) != 3 || !readDataResponse()) {
+          if (this->unrecoverableError)
+            return false;
+
+          if (GS_LOG_ERRORS && this->error) {
+            this->error->print("Sending queued bulk data frame failed for cid ");
+            this->error->println(cid);
+          }
+          processWriteFailure(cid, offset);
+          // The data will never be written, but it is no longer queued
+          this->connections[cid].tx_completed += len;
+          popTxQueue(len);
+          continue;
+        }
+        this->tx_queue_sent = 3;
+      }
+    }
+
+    // Write the (remainder of the) header
+    if (this->tx_queue_sent < headerlen) {
+      uint8_t todo = headerlen - this->tx_queue_sent;
+      uint16_t done = writeRawInternal(header + this->tx_queue_sent, todo, block);
+      this->tx_queue_sent += done;
+      if (done < todo)
+        return false;
+    }
+
+    // Write the (remainder of the) data, which might wrap around
+    while (this->tx_queue_sent < headerlen + len) {
+      uint16_t offset = this->tx_queue_sent - headerlen;
+      uint16_t index = (this->tx_queue_tail + TX_QUEUE_FRAME_OVERHEAD + offset) % TX_QUEUE_SIZE;
+      uint16_t todo = len - offset;
+      if (todo > TX_QUEUE_SIZE - index)
+        todo = TX_QUEUE_SIZE - index;
+
+      uint16_t done = writeRawInternal(this->tx_queue + index, todo, block);
+      this->tx_queue_sent += done;
+      this->connections[cid].tx_completed += done;
+      if (done < todo)
+        return false;
+    }
+
+    // Frame complete, remove it from the queue
+    popTxQueue(len);
+  }
   return true;
 }
 
+void GSCore::popTxQueue(uint16_t len)
+{
+  this->tx_queue_tail = (this->tx_queue_tail + TX_QUEUE_FRAME_OVERHEAD + len) % TX_QUEUE_SIZE;
+  this->tx_queue_len -= TX_QUEUE_FRAME_OVERHEAD + len;
+  this->tx_queue_sent = 0;
+}
+
 bool GSCore::writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *buf, uint16_t len)
 {
   if (cid > MAX_CID)
     return false;
 
-  // Hardware doesn't support more than 1400, according to SERIAL-TO-WIFI ADAPTER
-  // APPLICATION PROGRAMMING GUIDE, section 3.4.1 ("Bulk data Tx and Rx")
-  if (len > 1400)
+  // UDP server frames cannot be split, since that would send two
+  // packets instead of one
+  if (len > MAX_DATA_FRAME_SIZE)
     return false;
 
-  uint8_t ipbuf[16];
-  snprintf((char*)ipbuf, sizeof(ipbuf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  uint8_t dest[MAX_FRAME_DEST_SIZE];
+  uint8_t dest_len = formatFrameDestination(dest, ip, port);
 
   if (GS_DUMP_LINES && this->debug) {
     this->debug->print(">>| Writing UDP server bulk data frame for cid ");
     this->debug->print(cid);
     this->debug->print(" to ");
-    this->debug->print((const char*)ipbuf);
-    this->debug->print(":");
-    this->debug->print(port);
+    this->debug->write(dest, dest_len - 1);
     this->debug->print(" containing ");
     this->debug->print(len);
     this->debug->println(" bytes");
   }
 
-  uint8_t header[28]; // Including a trailing 0 that snprintf insists to write
-  // TODO: Also support UDP server
-  size_t headerlen = snprintf((char*)header, sizeof(header), "\x1bY%x%s:%u:%04d", cid, ipbuf, port, len);
+  uint8_t header[MAX_FRAME_HEADER_SIZE];
+  uint8_t headerlen = formatFrameHeader(header, cid, dest, dest_len, len);
+
+  // Keep data queued by writeDataAsync in order
+  if (!drainTxQueue(true))
+    return false;
 
   // First, write the escape sequence up to the cid. After this, the
   // module responds with <ESC>O or <ESC>F.
-  writeRaw(header, 3);
-  if (!readDataResponse()) {
+  if (!waitTxPending(MAX_TX_PENDING - 1))
+    return false;
+  addTxPending(cid, 0, len);
+  if (writeRaw(header, 3) != 3 || !readDataResponse()) {
     if (GS_LOG_ERRORS && this->error)
       this->error->println("Sending UDP server bulk data frame failed");
     return false;
   }
 
   // Then, write the rest of the escape sequence
-  writeRaw(header + 3, headerlen - 3);
   // TODO: the rest of the header can trigger an <ESC>F reply (but no
   // <ESC>O if everything is ok...)
-
   // And write the actual data
-  writeRaw(buf, len);
+  if (writeRaw(header + 3, headerlen - 3) != headerlen - 3 || writeRaw(buf, len) != len) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("Writing UDP server bulk data frame timed out");
+    return false;
+  }
   return true;
 }
 
+uint8_t GSCore::writeDataBatch(cid_t cid, TXFrame *frames, uint8_t count)
+{
+  // Index of the next frame that is waiting for its reply
+  uint8_t next_reply = 0;
+  uint8_t ok = 0;
+
+  // The destination of the previous frame, formatted as "ip:port:", so
+  // it can be reused when the next frame goes to the same place.
+  uint8_t dest[MAX_FRAME_DEST_SIZE];
+  uint8_t dest_len = 0;
+  uint32_t dest_ip = 0;
+  uint16_t dest_port = 0;
+
+  // Keep data queued by writeDataAsync in order
+  drainTxQueue(true);
+
+  // The payload of a rejected frame ends up at the command interpreter,
+  // so no command replies may be due when sending frames back to back
+  // (see commandReplyPending)
+  waitAsyncCommand();
+  waitBatchReplies();
+
+  for (uint8_t i = 0; i <= count; ++i) {
+    // Collect replies for frames sent earlier. Normally, only wait when
+    // too many replies are outstanding, but after the last frame, wait
+    // for all of them.
+    while (next_reply < i && (i == count || i - next_reply >= MAX_TX_PENDING)) {
+      TXFrame& f = frames[next_reply++];
+      // Frames that were not sent do not get a reply
+      if (!f.ok)
+        continue;
+      f.ok = readDataResponse();
+      if (f.ok)
+        ++ok;
+      else if (GS_LOG_ERRORS && this->error)
+        this->error->println("Sending batched bulk data frame failed");
+    }
+
+    if (i == count)
+      break;
+
+    TXFrame& frame = frames[i];
+    frame.ok = (cid <= MAX_CID && frame.length <= MAX_DATA_FRAME_SIZE && !this->unrecoverableError);
+    if (!frame.ok)
+      continue;
+
+    // After a frame was rejected, get the module back in sync before
+    // sending more. This collects the replies to all frames in flight,
+    // which are then picked up from tx_replies above.
+    if (this->tx_resync && !resyncTx()) {
+      frame.ok = false;
+      continue;
+    }
+
+    uint8_t header[MAX_FRAME_HEADER_SIZE];
+    uint8_t headerlen;
+    if (frame.port) {
+      if (dest_port != frame.port || dest_ip != (uint32_t)frame.ip || !dest_len) {
+        dest_ip = frame.ip;
+        dest_port = frame.port;
+        dest_len = formatFrameDestination(dest, frame.ip, frame.port);
+      }
+      headerlen = formatFrameHeader(header, cid, dest, dest_len, frame.length);
+    } else {
+      headerlen = formatFrameHeader(header, cid, NULL, 0, frame.length);
+    }
+
+    if (GS_DUMP_LINES && this->debug) {
+      this->debug->print(">>| Writing batched bulk data frame for cid ");
+      this->debug->print(cid);
+      if (frame.port) {
+        this->debug->print(" to ");
+        this->debug->write(dest, dest_len - 1);
+      }
+      this->debug->print(" containing ");
+      this->debug->print(frame.length);
+      this->debug->println(" bytes");
+    }
+
+    // Write the entire frame in one go, the reply to it is collected
+    // later. Pipelined frames from writeData might still be pending,
+    // so make sure there is room.
+    if (!waitTxPending(MAX_TX_PENDING - 1)) {
+      frame.ok = false;
+      continue;
+    }
+    addTxPending(cid, TX_PENDING_EARLY, frame.length);
+    if (writeRaw(header, headerlen) != headerlen || writeRaw(frame.buf, frame.length) != frame.length) {
+      // writeRaw flagged an unrecoverable error, so the remaining
+      // frames and replies will fail as well.
+      frame.ok = false;
+    }
+  }
+
+  return ok;
+}
+
+void GSCore::setTxPipelining(uint8_t depth)
+{
+  if (depth > MAX_TX_PENDING)
+    depth = MAX_TX_PENDING;
+  this->tx_pipeline_depth = depth;
+}
+
+bool GSCore::flushData()
+{
+  return drainTxQueue(true) && waitTxPending(0);
+}
+
 /*******************************************************
  * Methods for writing commands / reading replies
  *******************************************************/
 
+GSCore::Command GSCore::command(const char *start, TimeoutClass cls)
+{
+  // The reply to a pending command must be read before the next
+  // command can be sent
+  waitAsyncCommand();
+  // Data queued by writeDataAsync must go out before the command,
+  // e.g. before an AT+NCLOSE for the same cid
+  syncTx();
+  this->command_timeout_class = cls;
+
+  if (GS_DUMP_LINES && this->debug)
+    this->debug->print(">>= ");
+  return Command(*this).str(start);
+}
+
+GSCore::Command GSCore::command(const __FlashStringHelper *start, TimeoutClass cls)
+{
+  waitAsyncCommand();
+  syncTx();
+  this->command_timeout_class = cls;
+
+  if (GS_DUMP_LINES && this->debug)
+    this->debug->print(">>= ");
+  return Command(*this).str(start);
+}
+
+GSCore::Command& GSCore::Command::str(const char *s)
+{
+  gs.writeCommandPart((const uint8_t*)s, strlen(s));
+  return *this;
+}
+
+GSCore::Command& GSCore::Command::str(const __FlashStringHelper *s)
+{
+  // Copy the string from flash in small pieces
+  const char *p = (const char*)s;
+  uint8_t buf[16];
+  uint8_t len = 0;
+  while (true) {
+    uint8_t c = pgm_read_byte(p++);
+    if (c)
+      buf[len++] = c;
+    if (len && (!c || len == sizeof(buf))) {
+      gs.writeCommandPart(buf, len);
+      len = 0;
+    }
+    if (!c)
+      return *this;
+  }
+}
+
+GSCore::Command& GSCore::Command::chr(char c)
+{
+  gs.writeCommandPart((const uint8_t*)&c, 1);
+  return *this;
+}
+
+GSCore::Command& GSCore::Command::quoted(const char *s)
+{
+  return chr('"').str(s).chr('"');
+}
+
+GSCore::Command& GSCore::Command::num(uint32_t n)
+{
+  // A uint32_t has at most 10 decimal digits
+  uint8_t buf[10];
+  gs.writeCommandPart(buf, formatNumber(buf, n));
+  return *this;
+}
+
+GSCore::Command& GSCore::Command::hex(uint32_t n)
+{
+  // A uint32_t has at most 8 hexadecimal digits
+  uint8_t buf[8];
+  gs.writeCommandPart(buf, formatNumber(buf, n, 16));
+  return *this;
+}
+
+GSCore::Command& GSCore::Command::ip(const IPAddress& ip)
+{
+  uint8_t buf[15];
+  gs.writeCommandPart(buf, formatIpAddress(buf, ip));
+  return *this;
+}
+
+void GSCore::Command::send()
+{
+  if (GS_DUMP_LINES && gs.debug)
+    gs.debug->println();
+
+  const uint8_t eol[] = {'\r', '\n'};
+  gs.writeRaw(eol, sizeof(eol));
+}
+
+bool GSCore::Command::checkOk(void (*on_ok)(GSCore &gs))
+{
+  send();
+  if (gs.addBatchCommand(on_ok))
+    return true;
+  if (gs.readResponse() != GS_SUCCESS)
+    return false;
+  if (on_ok)
+    on_ok(gs);
+  return true;
+}
+
+void GSCore::Command::sendAsync(AsyncCommand *cmd)
+{
+  // Start listening for the reply before the module can send it
+  gs.startAsyncCommand(cmd);
+  send();
+}
+
+void GSCore::startAsyncCommand(AsyncCommand *cmd)
+{
+  // Replies are read in order, so the replies to any batched commands
+  // come first
+  waitBatchReplies();
+
+  cmd->pending = true;
+  cmd->response = GS_UNKNOWN_RESPONSE;
+  this->async_command = cmd;
+  startResponse(this->async_response_buf, sizeof(this->async_response_buf), &cmd->cid,
+                cmd->line_callback != NULL, cmd->line_callback, cmd->line_data);
+}
+
+void GSCore::processAsyncCommand()
+{
+  AsyncCommand *cmd = this->async_command;
+  if (!cmd)
+    return;
+
+  if (!this->response.done) {
+    if (this->unrecoverableError) {
+      this->response.active = false;
+      this->response.result = GS_UNRECOVERABLE_ERROR;
+    } else if ((unsigned long)(millis() - this->response.start) <= this->response.timeout) {
+      return;
+    } else {
+      this->response.result = processResponseTimeout();
+    }
+  }
+
+  this->async_command = NULL;
+  cmd->response = this->response.result;
+  // finish might send a followup command
+  if (cmd->finish && !cmd->finish(*this, cmd))
+    return;
+
+  cmd->pending = false;
+  if (cmd->onComplete)
+    cmd->onComplete(cmd->data, cmd);
+}
+
+bool GSCore::waitAsyncCommand()
+{
+  while (this->async_command) {
+    processIncoming(readRaw());
+    processAsyncCommand();
+  }
+  return !this->unrecoverableError;
+}
+
+void GSCore::beginBatch(GSResponse *results, uint8_t size)
+{
+  // Replies to commands sent before the batch are not part of it
+  waitAsyncCommand();
+  waitBatchReplies();
+
+  this->batch.results = results;
+  this->batch.size = size;
+  this->batch.sent = this->batch.read = 0;
+  this->batch.failed = false;
+  this->batch.active = true;
+}
+
+bool GSCore::endBatch()
+{
+  waitBatchReplies();
+  this->batch.active = false;
+  return !this->batch.failed;
+}
+
+bool GSCore::addBatchCommand(void (*on_ok)(GSCore &gs))
+{
+  if (!this->batch.active || this->batch.sent == this->batch.size)
+    return false;
+
+  this->batch.classes[this->batch.sent % MAX_BATCH_PENDING] = this->command_timeout_class;
+  this->batch.on_ok[this->batch.sent % MAX_BATCH_PENDING] = on_ok;
+  this->batch.sent++;
+
+  // Don't let the module get too far behind
+  if (this->batch.sent - this->batch.read == MAX_BATCH_PENDING)
+    readBatchReply();
+
+  return true;
+}
+
+void GSCore::readBatchReply()
+{
+  uint8_t i = this->batch.read;
+  TimeoutClass cls = this->batch.classes[i % MAX_BATCH_PENDING];
+  void (*on_ok)(GSCore &gs) = this->batch.on_ok[i % MAX_BATCH_PENDING];
+
+  startResponse(this->async_response_buf, sizeof(this->async_response_buf), NULL, false, NULL, NULL);
+  this->response.timeout_class = cls;
+  this->response.timeout = getTimeout(cls);
+
+  GSResponse res = waitResponse();
+  if (res != GS_SUCCESS)
+    this->batch.failed = true;
+  if (this->batch.results)
+    this->batch.results[i] = res;
+  this->batch.read++;
+
+  // The replies to the remaining commands can no longer be matched to
+  // their commands, so give up on them. syncTx drops them should they
+  // arrive.
+  while (res == GS_RESPONSE_TIMEOUT && this->batch.read != this->batch.sent) {
+    if (this->batch.results)
+      this->batch.results[this->batch.read] = res;
+    this->batch.read++;
+  }
+
+  // Only now the command is known to have succeeded, so apply its side
+  // effects
+  if (res == GS_SUCCESS && on_ok)
+    on_ok(*this);
+}
+
+bool GSCore::waitBatchReplies()
+{
+  if (!this->batch.active)
+    return !this->unrecoverableError;
+
+  while (this->batch.read != this->batch.sent)
+    readBatchReply();
+  return !this->unrecoverableError;
+}
+
+void GSCore::writeCommandPart(const uint8_t *buf, uint16_t len)
+{
+  if (GS_DUMP_LINES && this->debug)
+    this->debug->write(buf, len);
+  writeRaw(buf, len);
+}
+
 void GSCore::writeCommand(const char *fmt, ...)
 {
   va_list args;
 
-  va_start(args, fmt);
-  writeCommand(fmt, args);
-  va_end(args);
+  va_start(args, fmt);
+  writeCommand(fmt, args);
+  va_end(args);
+}
+
+void GSCore::writeCommand(const char *fmt, va_list args)
+{
+  // The reply to a pending command must be read before the next
+  // command can be sent
+  waitAsyncCommand();
+  syncTx();
+  this->command_timeout_class = GS_TIMEOUT_OTHER;
+
+  uint8_t buf[128];
+  size_t len = vsnprintf((char*)buf, sizeof(buf) - 2, fmt, args);
+  if (len > sizeof(buf) - 2) {
+    len = sizeof(buf) - 2;
+    if (GS_LOG_ERRORS && this->error) {
+      this->error->print("Command truncated: ");
+      this->error->write(buf, len);
+      this->error->println();
+    }
+  }
+
+  if (GS_DUMP_LINES && this->debug) {
+    this->debug->print(">>= ");
+    this->debug->write(buf, len);
+    this->debug->println();
+  }
+
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+
+  this->writeRaw(buf, len);
+}
+
+bool GSCore::writeCommandCheckOk(const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  writeCommand(fmt, args);
+  va_end(args);
+
+  return (readResponse() == GS_SUCCESS);
+}
+
+GSCore::GSResponse GSCore::readResponseInternal(uint8_t *buf, uint16_t* len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data)
+{
+  // Replies are read in order, so first finish reading the reply to
+  // any pending asynchronous command.
+  if (!waitAsyncCommand() || !waitBatchReplies())
+    return GS_UNRECOVERABLE_ERROR;
+
+  startResponse(buf, *len, connect_cid, keep_data, callback, data);
+  GSResponse res = waitResponse();
+  *len = this->response.read;
+  return res;
+}
+
+GSCore::GSResponse GSCore::waitResponse()
+{
+  while(!this->response.done) {
+    if (this->unrecoverableError) {
+      this->response.active = false;
+      return GS_UNRECOVERABLE_ERROR;
+    }
+
+    int c = readRaw();
+    if (c == -1) {
+      if ((unsigned long)(millis() - this->response.start) > this->response.timeout)
+        return processResponseTimeout();
+      continue;
+    }
+
+    // This handles connection and async data and passes anything else
+    // to processResponseByte.
+    processIncoming(c);
+  }
+
+  return this->response.result;
+}
+
+/**
+ * The lower and upper limits for the timeout of each TimeoutClass, in
+ * milliseconds. Until enough response times were seen, the upper limit
+ * is used.
+ */
+static void timeout_limits(GSCore::TimeoutClass cls, uint16_t *min, uint16_t *max)
+{
+  switch (cls) {
+    case GSCore::GS_TIMEOUT_LOCAL:
+      *min = 500; *max = 5000;
+      break;
+    case GSCore::GS_TIMEOUT_NETWORK:
+      *min = 2000; *max = 20000;
+      break;
+    case GSCore::GS_TIMEOUT_ASSOCIATE:
+      *min = 10000; *max = 30000;
+      break;
+    case GSCore::GS_TIMEOUT_SCAN:
+      *min = 2000; *max = 20000;
+      break;
+    case GSCore::GS_TIMEOUT_REMOTE:
+      *min = 3000; *max = 20000;
+      break;
+    default:
+      *min = *max = GSCore::RESPONSE_TIMEOUT;
+      break;
+  }
+}
+
+unsigned long GSCore::getTimeout(TimeoutClass cls)
+{
+  if (this->timeouts[cls].fixed)
+    return this->timeouts[cls].fixed;
+
+  uint16_t min, max;
+  timeout_limits(cls, &min, &max);
+  if (this->timeouts[cls].samples < MIN_TIMEOUT_SAMPLES)
+    return max;
+
+  // Like TCP, use the smoothed response time plus four times the
+  // deviation, which should cover nearly all responses, and then add
+  // a generous margin since a timeout is expensive.
+  unsigned long timeout = 2 * ((unsigned long)this->timeouts[cls].srtt + 4 * this->timeouts[cls].rttvar);
+  if (timeout < min)
+    return min;
+  if (timeout > max)
+    return max;
+  return timeout;
+}
+
+GSCore::GSResponse GSCore::processResponseTimeout()
+{
+  this->response.active = false;
+
+  // Commands in these classes only involve the module itself, so a
+  // reply that did not arrive in time is most likely lost. Should it
+  // still arrive, it is dropped before the next command (see syncTx).
+  TimeoutClass cls = this->response.timeout_class;
+  if (cls == GS_TIMEOUT_LOCAL || cls == GS_TIMEOUT_NETWORK) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("Response timeout, continuing");
+    this->lost_reply_timeout = this->response.timeout;
+    return GS_RESPONSE_TIMEOUT;
+  }
+
+  if (GS_LOG_ERRORS && this->error)
+    this->error->println("Response timeout");
+  // On a response timeout, our state will be (and probably stay)
+  // wrong. Flag an unrecoverable error.
+  this->unrecoverableError = true;
+  return GS_UNRECOVERABLE_ERROR;
 }
 
-void GSCore::writeCommand(const char *fmt, va_list args)
+void GSCore::processResponseTime(TimeoutClass cls, unsigned long ms)
 {
-  uint8_t buf[128];
-  size_t len = vsnprintf((char*)buf, sizeof(buf) - 2, fmt, args);
-  if (len > sizeof(buf) - 2) {
-    len = sizeof(buf) - 2;
-    if (GS_LOG_ERRORS && this->error) {
-      this->error->print("Command truncated: ");
-      this->error->write(buf, len);
-      this->error->println();
-    }
+  if (GS_LOG_ERRORS && this->error && ms > getTimeout(cls)) {
+    this->error->print("Slow response: ");
+    this->error->print(ms);
+    this->error->println("ms");
   }
 
-  if (GS_DUMP_LINES && this->debug) {
-    this->debug->print(">>= ");
-    this->debug->write(buf, len);
-    this->debug->println();
+  if (ms > max_for_type(uint16_t))
+    ms = max_for_type(uint16_t);
+
+  if (!this->timeouts[cls].samples) {
+    this->timeouts[cls].srtt = ms;
+    this->timeouts[cls].rttvar = ms / 2;
+  } else {
+    // Same smoothing as TCP (RFC 6298): alpha = 1/8, beta = 1/4
+    long err = (long)ms - this->timeouts[cls].srtt;
+    this->timeouts[cls].srtt += err / 8;
+    long dev = (err < 0 ? -err : err) - this->timeouts[cls].rttvar;
+    this->timeouts[cls].rttvar += dev / 4;
   }
 
-  buf[len++] = '\r';
-  buf[len++] = '\n';
+  if (this->timeouts[cls].samples < MIN_TIMEOUT_SAMPLES)
+    this->timeouts[cls].samples++;
+}
 
-  this->writeRaw(buf, len);
+void GSCore::startResponse(uint8_t *buf, uint16_t len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data)
+{
+  this->response.buf = buf;
+  this->response.size = len;
+  this->response.read = 0;
+  this->response.line_start = 0;
+  this->response.connect_cid = connect_cid;
+  this->response.callback = callback;
+  this->response.data = data;
+  this->response.start = millis();
+  this->response.timeout_class = this->command_timeout_class;
+  this->response.timeout = getTimeout(this->command_timeout_class);
+  this->response.keep_data = keep_data;
+  this->response.dropped_data = false;
+  this->response.skip_line = false;
+  this->response.in_tail = false;
+  this->response.tail_len = 0;
+  this->response.done = false;
+  this->response.active = true;
 }
 
-bool GSCore::writeCommandCheckOk(const char *fmt, ...)
+void GSCore::processResponseByte(uint8_t c)
 {
-  va_list args;
+  uint8_t *buf = this->response.buf;
+  uint16_t &read = this->response.read;
+  uint16_t &line_start = this->response.line_start;
+  bool keep_data = this->response.keep_data;
+  line_callback_t callback = this->response.callback;
+
+  if ((c == '\r' || c == '\n')) {
+    // The current line is either in buf, or in tail when it did not
+    // fit in buf
+    const uint8_t *line = buf + line_start;
+    uint16_t line_len = read - line_start;
+    if (this->response.in_tail) {
+      line = this->response.tail;
+      line_len = this->response.tail_len;
+    }
 
-  va_start(args, fmt);
-  writeCommand(fmt, args);
-  va_end(args);
+    // This normalizes all sequences of line endings into a single
+    // \r\n and strips leading \r\n sequences, because responses tend
+    // to use a lot of extra \r\n (or \n or even \n\r :-S) sequences.
+    // As a side effect, this removes empty lines from output, but
+    // that's ok.
+    if (line_len == 0 && !this->response.skip_line)
+      return;
 
-  return (readResponse() == GS_SUCCESS);
-}
+    this->response.in_tail = false;
+    this->response.tail_len = 0;
 
-GSCore::GSResponse GSCore::readResponseInternal(uint8_t *buf, uint16_t* len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data)
-{
-  uint16_t read = 0;
-  uint16_t line_start = 0;
-  bool dropped_data = false;
-  bool skip_line = false;
-  GSResponse res;
-  unsigned long start = millis();
-  while(true) {
-    if (this->unrecoverableError)
-      return GS_UNRECOVERABLE_ERROR;
+    if (this->response.skip_line) {
+      // Data from this line has been dropped because the buffer was
+      // full, and it was too long for a response anyway, so further
+      // ignore this line.
+      this->response.skip_line = false;
+      // Remove the line from the buffer
+      read = line_start;
+      if (GS_DUMP_LINES && this->debug)
+        this->debug->println("<<| Skipped uninteresting long line");
+      return;
+    }
 
-    int c = readRaw();
-    if (c == -1) {
-      if ((unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
+    GSResponse res = processResponseLine(line, line_len, this->response.connect_cid);
+    // When we get a GS_LINK_LOST, we're apparently not associated
+    // when we thought we would be. Call processDisassciation() to fix
+    // that.
+    if (res == GS_LINK_LOST)
+      processDisassociation();
+
+    if (keep_data && !callback && !this->response.dropped_data && res == GS_UNKNOWN_RESPONSE && line == buf + line_start) {
+      // Unknown response, so it's probably actual data that the
+      // caller will want to have. Leave it in the buffer, and
+      // terminate it with \r\n.
+      if (read < this->response.size) buf[read++] = '\r';
+      if (read < this->response.size) buf[read++] = '\n';
+      line_start = read;
+    } else {
+      // If we have a callback, pass any unknown response to it
+      if (keep_data && callback && res == GS_UNKNOWN_RESPONSE)
+        callback(line, line_len, this->response.data);
+
+      // A data line that did not fit in the buffer is lost, so don't
+      // store any further data (to make sure the returned data is
+      // cleanly truncated instead of having gaps).
+      if (keep_data && !callback && res == GS_UNKNOWN_RESPONSE && line != buf + line_start) {
         if (GS_LOG_ERRORS && this->error)
-          this->error->println("Response timeout");
-        // On a response timeout, our state will be (and probably stay)
-        // wrong. Flag an unrecoverable error.
-        this->unrecoverableError = true;
-        return GS_UNRECOVERABLE_ERROR;
+          this->error->println("Response buffer too small, dropped line");
+        this->response.dropped_data = true;
       }
-      continue;
-    }
 
-    if (this->rx_state != GS_RX_IDLE || c == 0x1b) {
-      // We're currently handling connection or async data, or are about
-      // to. Let processIncoming sort that out.
-      processIncoming(c);
-    } else if ((c == '\r' || c == '\n')) {
-      // This normalizes all sequences of line endings into a single
-      // \r\n and strips leading \r\n sequences, because responses tend
-      // to use a lot of extra \r\n (or \n or even \n\r :-S) sequences.
-      // As a side effect, this removes empty lines from output, but
-      // that's ok.
-      if (read - line_start == 0)
-        continue;
+      // Remove the line from the buffer since we either handled it
+      // already, or we're not interested in the data
+      read = line_start;
 
-      if (skip_line) {
-        // Data from this line has been dropped because the buffer was
-        // full, and it was too long for a response anyway, so further
-        // ignore this line.
-        skip_line = false;
-        // Remove the line from the buffer
-        read = line_start;
-        if (GS_DUMP_LINES && this->debug)
-          this->debug->println("<<| Skipped uninteresting long line");
-        continue;
+      if (res != GS_UNKNOWN_RESPONSE && res != GS_CON_SUCCESS) {
+        // All other responses indicate the end of the reply
+        this->response.result = res;
+        this->response.done = true;
+        this->response.active = false;
+        processResponseTime(this->response.timeout_class, millis() - this->response.start);
       }
-      skip_line = false;
-
-      res = processResponseLine(buf + line_start, read - line_start, connect_cid);
-      // When we get a GS_LINK_LOST, we're apparently not associated
-      // when we thought we would be. Call processDisassciation() to fix
-      // that.
-      if (res == GS_LINK_LOST)
-        processDisassociation();
-
-      if (keep_data && !callback && !dropped_data && res == GS_UNKNOWN_RESPONSE) {
-        // Unknown response, so it's probably actual data that the
-        // caller will want to have. Leave it in the buffer, and
-        // terminate it with \r\n.
-        if (read < *len) buf[read++] = '\r';
-        if (read < *len) buf[read++] = '\n';
-        line_start = read;
-      } else {
-        // If we have a callback, pass any unknown response to it
-        if (keep_data && callback && res == GS_UNKNOWN_RESPONSE)
-          callback(&buf[line_start], read - line_start, data);
-
-        // Remove the line from the buffer since we either handled it
-        // already, or we're not interested in the data
-        read = line_start;
-
-        if (res != GS_UNKNOWN_RESPONSE && res != GS_CON_SUCCESS) {
-          // All other responses indicate the end of the reply
-          *len = read;
-          return res;
-        }
+    }
+  } else if (this->response.skip_line) {
+    // Already known to be an uninteresting long line
+  } else if (!this->response.in_tail && read < this->response.size) {
+    buf[read++] = c;
+  } else {
+    // The buffer is full, but we can't just discard the byte: It might
+    // be part of the final response we're waiting for. Instead, keep
+    // the (start of the) current line in tail, which is big enough for
+    // any response. Since tail is small, this takes constant time per
+    // byte and the data already in buf is left alone.
+    if (!this->response.in_tail) {
+      uint16_t line_len = read - line_start;
+      if (line_len < MAX_RESPONSE_SIZE) {
+        memcpy(this->response.tail, buf + line_start, line_len);
+        this->response.tail_len = line_len;
+        this->response.in_tail = true;
       }
-    } else {
-      if (read < *len) {
-        buf[read++] = c;
-      } else if ((read - line_start) >= MAX_RESPONSE_SIZE ) {
-        // The buffer is full. However, the line is too long for a
-        // response, so there is no danger in just discarding the byte.
-        if (keep_data && GS_LOG_ERRORS && this->error)
-          dump_byte(this->error, "Response buffer too small, dropped byte: ", c);
-
-        // Make sure we won't try to parse the few bytes we have as a
-        // response.
-        skip_line = true;
-        dropped_data = true;
-      } else {
-        // The buffer is full, but we can't just discard the byte: It
-        // might be part of the final response we're waiting for.
-        // Instead, drop the last byte of the previous line to make
-        // room, and move any data in the current line accordingly.
-        if (line_start > 0) {
-          if (keep_data && GS_LOG_ERRORS && this->error)
-            dump_byte(this->error, "Response buffer too small, removed byte: ", buf[line_start - 1]);
-          memmove(&buf[line_start - 1], &buf[line_start], (read - line_start));
-          line_start--;
-          buf[read] = c;
-        } else {
-          // line_start == 0 should only happen if len <
-          // MAX_RESPONSE_SIZE, but better be safe than sorry.
-          if (keep_data && GS_LOG_ERRORS && this->error)
-            dump_byte(this->error, "Response buffer tiny? Dropped byte: ", c);
-        }
+      read = line_start;
+    }
 
-        // Once we threw away a byte of data, don't store any new ones
-        // (to make sure the returned data is cleanly truncated instead
-        // of having gaps).
-        dropped_data = true;
-      }
+    if (this->response.in_tail && this->response.tail_len < MAX_RESPONSE_SIZE) {
+      this->response.tail[this->response.tail_len++] = c;
+    } else {
+      // The line is too long for a response, so there is no danger in
+      // just discarding it.
+      if (keep_data && GS_LOG_ERRORS && this->error)
+        dump_byte(this->error, "Response buffer too small, dropped byte: ", c);
+
+      this->response.in_tail = false;
+      this->response.tail_len = 0;
+      this->response.skip_line = true;
+      this->response.dropped_data = true;
     }
   }
 }
@@ -609,7 +1714,9 @@ GSCore::GSResponse GSCore::readResponse(line_callback_t callback, void *data, ci
 bool GSCore::readDataResponse()
 {
   unsigned long start = millis();
-  while(true) {
+  // Replies are stored in tx_replies by processIncoming, possibly
+  // already while we were still writing data.
+  while(this->tx_replies_len == 0) {
     int c = readRaw();
     if (this->unrecoverableError)
       return false;
@@ -626,20 +1733,13 @@ bool GSCore::readDataResponse()
       continue;
     }
 
-    if (this->rx_state == GS_RX_ESC && c == 'O') {
-      if (GS_DUMP_LINES && this->debug)
-        this->debug->println("<<| Read data OK response");
-      this->rx_state = GS_RX_IDLE;
-      return true;
-    } else if (this->rx_state == GS_RX_ESC && c == 'F') {
-      if (GS_DUMP_LINES && this->debug)
-        this->debug->println("<<| Read data FAIL response");
-      this->rx_state = GS_RX_IDLE;
-      return false;
-    } else {
-      processIncoming(c);
-    }
+    processIncoming(c);
   }
+
+  bool ok = this->tx_replies & 1;
+  this->tx_replies >>= 1;
+  this->tx_replies_len--;
+  return ok;
 }
 
 
@@ -661,21 +1761,33 @@ uint8_t GSCore::transferSpi(uint8_t out)
   return in;
 }
 
-void GSCore::writeRaw(const uint8_t *buf, uint16_t len)
+uint16_t GSCore::writeRaw(const uint8_t *buf, uint16_t len)
+{
+  // Finish any queued frame that was partially written first, since
+  // nothing can be sent in the middle of it.
+  if (this->tx_queue_sent && !drainTxQueue(true))
+    return 0;
+
+  return writeRawInternal(buf, len, true);
+}
+
+uint16_t GSCore::writeRawInternal(const uint8_t *buf, uint16_t len, bool block)
 {
+  uint16_t done = 0;
   if (this->serial) {
     if (this->unrecoverableError)
-      return;
+      return 0;
     if (GS_DUMP_BYTES && this->debug) {
       for (uint16_t i = 0; i < len; ++i)
         dump_byte(this->debug, ">= ", buf[i]);
     }
-    this->serial->write(buf, len);
+    done = this->serial->write(buf, len);
   } else if (this->ss_pin) {
-    uint16_t tries = 1024; // max 1k per loop
+    // When not blocking, poll just once to see if XOFF was lifted
+    uint16_t tries = block ? 1024 : 1; // max 1k per loop
     while (len && tries > 0) {
       if (this->unrecoverableError)
-        return;
+        return done;
       if (this->spi_xoff) {
         // Module sent XOFF, so send IDLE bytes until it reports it has
         // buffer space again.
@@ -692,8 +1804,33 @@ void GSCore::writeRaw(const uint8_t *buf, uint16_t len)
         }
         buf++;
         len--;
+        done++;
       }
     }
+
+    if (len && block && !this->unrecoverableError) {
+      if (GS_LOG_ERRORS && this->error)
+        this->error->println("Write timeout, module does not accept data");
+      // Part of a command or frame was lost, so the module will
+      // misinterpret whatever we send next.
+      this->unrecoverableError = true;
+    }
+  }
+  return done;
+}
+
+void GSCore::writeRaw_P(const uint8_t *buf, uint16_t len)
+{
+  // Copy the data from flash in small pieces
+  while (len) {
+    uint8_t tmp[STREAM_CHUNK_SIZE];
+    uint16_t chunk = sizeof(tmp);
+    if (len < chunk)
+      chunk = len;
+    memcpy_P(tmp, buf, chunk);
+    writeRaw(tmp, chunk);
+    buf += chunk;
+    len -= chunk;
   }
 }
 
@@ -809,10 +1946,69 @@ bool GSCore::parseIpAddress(IPAddress *ip, const char *str, uint16_t len)
   return true;
 }
 
+uint8_t GSCore::formatNumber(uint8_t *buf, uint32_t n, uint8_t base, uint8_t min_digits)
+{
+  if (base < 2 || base > 16)
+    base = 10;
+
+  // Generate the digits in reverse order, a uint32_t has at most 32
+  // digits (in base 2)
+  uint8_t tmp[32];
+  uint8_t len = 0;
+  do {
+    uint8_t digit = n % base;
+    tmp[len++] = (digit < 10 ? '0' + digit : 'a' + digit - 10);
+    n /= base;
+  } while (n);
+
+  uint8_t out = 0;
+  while (len + out < min_digits)
+    buf[out++] = '0';
+  while (len)
+    buf[out++] = tmp[--len];
+  return out;
+}
+
+uint8_t GSCore::formatIpAddress(uint8_t *buf, const IPAddress& ip)
+{
+  uint8_t len = 0;
+  for (uint8_t i = 0; i < 4; ++i) {
+    if (i)
+      buf[len++] = '.';
+    len += formatNumber(buf + len, ip[i]);
+  }
+  return len;
+}
+
 /*******************************************************
  * Internal helper methods
  *******************************************************/
 
+uint8_t GSCore::formatFrameDestination(uint8_t *buf, const IPAddress& ip, uint16_t port)
+{
+  uint8_t len = formatIpAddress(buf, ip);
+  buf[len++] = ':';
+  len += formatNumber(buf + len, port);
+  buf[len++] = ':';
+  return len;
+}
+
+uint8_t GSCore::formatFrameHeader(uint8_t *buf, cid_t cid, const uint8_t *dest, uint8_t dest_len, uint16_t len)
+{
+  // <ESC>Z<cid><length 4 ascii char> or
+  // <ESC>Y<cid><ip>:<port>:<length 4 ascii char>
+  uint8_t headerlen = 0;
+  buf[headerlen++] = 0x1b;
+  buf[headerlen++] = dest ? 'Y' : 'Z';
+  headerlen += formatNumber(buf + headerlen, cid, 16);
+  if (dest) {
+    memcpy(buf + headerlen, dest, dest_len);
+    headerlen += dest_len;
+  }
+  headerlen += formatNumber(buf + headerlen, len, 10, 4);
+  return headerlen;
+}
+
 int GSCore::processSpiSpecial(uint8_t c)
 {
   static uint8_t errorcount = 0;
@@ -899,6 +2095,8 @@ bool GSCore::processIncoming(int c)
       if (c == 0x1b) {
         // Escape character, incoming data
         this->rx_state = GS_RX_ESC;
+      } else if (this->response.active) {
+        processResponseByte(c);
       } else {
         // Don't log \r\n, since the synchronous response parsing
         // often leaves a \n behind. Only log in VERBOSE, since some
@@ -911,9 +2109,15 @@ bool GSCore::processIncoming(int c)
       break;
 
     case GS_RX_ESC:
-      // Note: <Esc>O and <Esc>F are handled in readDataResponse, since
-      // they should never be received asynchronously
       switch (c) {
+        case 'O':
+        case 'F':
+          // Reply to a data frame we sent. These are stored and then
+          // picked up by readDataResponse.
+          this->rx_state = GS_RX_IDLE;
+          processDataResponse(c == 'O');
+          break;
+
         case 'Z':
           // Incoming TCP client/server or UDP client data
           // <Esc>Z<CID><Data Length xxxx 4 ascii char><data>
@@ -1137,6 +2341,13 @@ void GSCore::bufferIncomingData(uint8_t c)
 
 void GSCore::bufferFrameHeader(const RXFrame *frame)
 {
+  // Let the application know there is data, unless it was already
+  // told
+  if (frame->cid <= MAX_CID && !(this->data_events & (1 << frame->cid))) {
+    if (queueEvent(GS_EVENT_DATA, frame->cid))
+      this->data_events |= (1 << frame->cid);
+  }
+
   if (this->rx_data_head == this->rx_data_tail) {
     // Ringbuffer is empty, so this frame becomes the tail_frame
     // directly.
@@ -1168,15 +2379,17 @@ void GSCore::bufferFrameHeader(const RXFrame *frame)
   }
 }
 
-void GSCore::loadFrameHeader(RXFrame* frame)
+void GSCore::loadFrameHeader(RXFrame* frame, rx_data_index_t *pos)
 {
-  if (sizeof(this->rx_data) - this->rx_data_tail < sizeof(*frame)) {
+  if (sizeof(this->rx_data) - *pos < sizeof(*frame)) {
     // The RXFrame structure didn't fit in the ringbuffer
     // consecutively. Skip a few bytes to skip back to the start
-    this->rx_data_tail = 0;
+    *pos = 0;
   }
-  memcpy(frame, &this->rx_data[this->rx_data_tail], sizeof(*frame));
-  this->rx_data_tail += sizeof(*frame);
+  // rx_data holds a byte copy made by bufferFrameHeader, which is not
+  // necessarily aligned for RXFrame, so copy it bytewise
+  memcpy((void*)frame, &this->rx_data[*pos], sizeof(*frame));
+  *pos += sizeof(*frame);
 }
 
 GSCore::RXFrame GSCore::getFrameHeader(cid_t cid)
@@ -1189,6 +2402,7 @@ GSCore::RXFrame GSCore::getFrameHeader(cid_t cid)
     } else {
       // The buffer is empty. See if we can read more data from the
       // module.
+      waitBatchReplies();
       while (this->tail_frame.length == 0) {
         // Don't block
         if (!processIncoming(readRaw()))
@@ -1223,26 +2437,206 @@ int GSCore::getData()
   }
 }
 
+void GSCore::refreshState()
+{
+  unsigned long now = millis();
+  if (this->state_refresh_interval && (unsigned long)(now - this->last_state_refresh) < this->state_refresh_interval)
+    return;
+
+  this->last_state_refresh = now;
+  readAndProcessAsync();
+}
+
 void GSCore::readAndProcessAsync()
+{
+  bool more;
+  readAndProcessAsync(0, 0, &more);
+}
+
+uint16_t GSCore::readAndProcessAsync(unsigned long start, uint32_t budget_us, bool *more)
 {
   // Read and process bytes until:
   //  - There are no more bytes to read.
   //  - We end up in a data packet (which we don't want to read all the
   //    way through, since it'll likely fill up our buffers.
+  //  - The budget is used up, or we processed 1k bytes when there is
+  //    no budget.
   //
   //  Note that we always read at least one byte, so if we start out in
   //  a data packet, we'll always advance it by one byte to prevent
   //  deadlocking ourselves.
-  uint16_t tries = 1024; // max 1k per loop
-  while (processIncoming(readRaw()) && tries-- > 0) {
+  uint16_t bytes = 0;
+  *more = false;
+  // Replies to batched commands must not be processed as async data
+  waitBatchReplies();
+  while (processIncoming(readRaw())) {
+    bytes++;
     switch (this->rx_state) {
       case GS_RX_ESC_Z:
       case GS_RX_BULK:
-        return;
+        return bytes;
       default:
-        continue;
+        break;
+    }
+
+    if (budget_us ? !budget_left(start, budget_us) : bytes > 1024) {
+      *more = true;
+      break;
+    }
+  }
+  return bytes;
+}
+
+void GSCore::processDataResponse(bool ok)
+{
+  if (GS_DUMP_LINES && this->debug) {
+    if (ok)
+      this->debug->println("<<| Read data OK response");
+    else
+      this->debug->println("<<| Read data FAIL response");
+  }
+
+  if (this->tx_unacked) {
+    uint8_t pending = this->tx_pending[this->tx_pending_head];
+    uint32_t offset = this->tx_pending_offset[this->tx_pending_head];
+    this->tx_pending_head = (this->tx_pending_head + 1) % MAX_TX_PENDING;
+    this->tx_unacked--;
+
+    if (!ok && (pending & TX_PENDING_EARLY)) {
+      // The payload of this frame was passed to the command
+      // interpreter, so there will be replies to that
+      this->tx_resync = true;
+    }
+
+    if (pending & TX_PENDING_DEFERRED) {
+      // Reply to a pipelined frame, nobody is waiting for this reply so
+      // handle it here.
+      if (!ok) {
+        cid_t cid = pending & ~(TX_PENDING_DEFERRED | TX_PENDING_EARLY);
+        if (GS_LOG_ERRORS && this->error) {
+          this->error->print("Sending pipelined bulk data frame failed for cid ");
+          this->error->print(cid);
+          this->error->print(" at offset ");
+          this->error->println(offset);
+        }
+        processWriteFailure(cid, offset);
+      }
+      return;
+    }
+  }
+
+  if (this->tx_replies_len >= sizeof(this->tx_replies) * 8) {
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("tx_replies is full, dropped data response");
+    return;
+  }
+
+  if (ok)
+    this->tx_replies |= (1 << this->tx_replies_len);
+  else
+    this->tx_replies &= ~(1 << this->tx_replies_len);
+  this->tx_replies_len++;
+}
+
+void GSCore::addTxPending(cid_t cid, uint8_t flags, uint16_t len)
+{
+  uint8_t index = (this->tx_pending_head + this->tx_unacked) % MAX_TX_PENDING;
+  this->tx_pending[index] = cid | flags;
+  this->tx_pending_offset[index] = this->connections[cid].tx_offset;
+  this->connections[cid].tx_offset += len;
+  this->tx_unacked++;
+}
+
+bool GSCore::waitTxPending(uint8_t max_pending)
+{
+  unsigned long start = millis();
+  while (this->tx_unacked > max_pending) {
+    int c = readRaw();
+    if (this->unrecoverableError)
+      return false;
+
+    if (c == -1) {
+      if ((unsigned long)(millis() - start) > RESPONSE_TIMEOUT) {
+        if (GS_LOG_ERRORS && this->error)
+          this->error->println("Data response timeout");
+        // On a response timeout, our state will be (and probably stay)
+        // wrong. Flag an unrecoverable error.
+        this->unrecoverableError = true;
+        return false;
+      }
+      continue;
+    }
+
+    processIncoming(c);
+  }
+  return true;
+}
+
+bool GSCore::syncTx()
+{
+  // A frame still waiting for its reply might turn out to be rejected,
+  // so wait for all replies before sending a command
+  if (!drainTxQueue(true) || !waitTxPending(0))
+    return false;
+
+  if (this->tx_resync && !resyncTx())
+    return false;
+
+  // A reply that timed out might still arrive, so drop it rather than
+  // taking it for the reply to the next command
+  if (this->lost_reply_timeout) {
+    unsigned long quiet = this->lost_reply_timeout;
+    this->lost_reply_timeout = 0;
+    return dropReplies(quiet);
+  }
+  return true;
+}
+
+bool GSCore::resyncTx()
+{
+  // Other frames in flight might be rejected as well
+  if (!waitTxPending(0))
+    return false;
+  this->tx_resync = false;
+
+  if (GS_LOG_ERRORS && this->error)
+    this->error->println("Data frame rejected after sending its payload, resyncing");
+
+  // The payload might end with a partial command line, terminate it so
+  // it is not prefixed to the next command
+  const uint8_t eol[] = {'\r', '\n'};
+  if (writeRaw(eol, sizeof(eol)) != sizeof(eol))
+    return false;
+
+  return dropReplies(RESYNC_QUIET_TIME);
+}
+
+bool GSCore::dropReplies(unsigned long quiet)
+{
+  // Anything outside of an escape sequence is a reply, since no
+  // command is pending. Escape sequences (e.g. incoming data) are
+  // processed as normal.
+  unsigned long start = millis();
+  unsigned long last = start;
+  while ((unsigned long)(millis() - last) < quiet) {
+    if ((unsigned long)(millis() - start) > quiet + RESPONSE_TIMEOUT) {
+      if (GS_LOG_ERRORS && this->error)
+        this->error->println("Resync timeout");
+      this->unrecoverableError = true;
+      return false;
     }
+
+    int c = readRaw();
+    if (this->unrecoverableError)
+      return false;
+    if (c == -1)
+      continue;
+
+    if (this->rx_state == GS_RX_IDLE && c != 0x1b)
+      last = millis();
+    processIncoming(c);
   }
+  return true;
 }
 
 void GSCore::dropData(uint8_t num_bytes) {
@@ -1253,6 +2647,9 @@ void GSCore::dropData(uint8_t num_bytes) {
         this->error->print("rx_data is full, dropped byte for cid ");
         this->error->println(cid);
       }
+      // Only report the first byte dropped
+      if (!this->connections[cid].error)
+        queueEvent(GS_EVENT_DATA_DROPPED, cid);
       this->connections[cid].error = true;
     }
   }
@@ -1474,6 +2871,7 @@ bool GSCore::processAsync()
           this->error->println(cid);
         }
         this->connections[cid].error = true;
+        queueEvent(GS_EVENT_SOCKET_FAILURE, cid);
       }
       processDisconnect(cid);
       return true;
@@ -1487,9 +2885,9 @@ bool GSCore::processAsync()
         case GS_ASYNC_FAILURE:
           // Means the Network Connection Manager has used all it's
           // retries and is giving up on setting up a L4 (TCP/UDP)
-          // connection (until the next (re)association). For now, just
-          // ignore.
-          return false;
+          // connection (until the next (re)association).
+          queueEvent(GS_EVENT_NCM_FAILURE);
+          return true;
 
         case GS_ASYNC_DISASSO_EVT:
           // TODO: This means the wifi association has broken. Update our
@@ -1498,12 +2896,16 @@ bool GSCore::processAsync()
           return true;
 
         case GS_ASYNC_STBY_TMR_EVT:
+          queueEvent(GS_EVENT_STANDBY_TIMER);
+          return true;
+
         case GS_ASYNC_STBY_ALM_EVT:
+          queueEvent(GS_EVENT_STANDBY_ALARM);
+          return true;
+
         case GS_ASYNC_DPSLEEP_EVT:
-          // TODO: These are given after the wifi module is told to go
-          // into standby. How to handle these? Perhaps just print some
-          // debug info for now and then ignore them?
-          return false;
+          queueEvent(GS_EVENT_DEEP_SLEEP);
+          return true;
 
         case GS_ASYNC_BOOT_UNEXPEC:
         case GS_ASYNC_BOOT_INTERNAL:
@@ -1514,10 +2916,13 @@ bool GSCore::processAsync()
           if (this->initializing)
             return true;
 
+          this->boot_count++;
+          queueEvent(GS_EVENT_BOOT);
+
           // TODO: Reset our state to match the hardware. Also make sure
           // to stop waiting for a reply to a command, since it will never
           // come.
-          return false;
+          return true;
 
         case GS_ASYNC_NWCONN_SUCCESS:
           // This means that the Network Connection Manager has
@@ -1552,10 +2957,7 @@ void GSCore::processAssociation()
     processDisassociation();
 
   this->associated = true;
-  // Keep track of the associated event, even when there is already a
-  // disassociated event (since a re-associate should not go by
-  // unnoticed
-  this->events |= EVENT_ASSOCIATED;
+  queueEvent(GS_EVENT_ASSOCIATED);
 }
 
 void GSCore::processDisassociation()
@@ -1563,14 +2965,9 @@ void GSCore::processDisassociation()
   if (!this->associated)
     return;
 
-  // If there is still an unprocessed association event, just cancel
-  // that.
-  if (this->events & EVENT_ASSOCIATED)
-    this->events &= ~EVENT_ASSOCIATED;
-  else
-    this->events |= EVENT_DISASSOCIATED;
-
   this->associated = false;
+  queueEvent(GS_EVENT_DISASSOCIATED);
+
   for (cid_t cid = 0; cid <= MAX_CID; ++cid) {
     if (this->connections[cid].connected) {
       this->connections[cid].error = true;
@@ -1579,6 +2976,112 @@ void GSCore::processDisassociation()
   }
 }
 
+void GSCore::processWriteFailure(cid_t cid, uint32_t offset)
+{
+  ConnectionInfo &info = this->connections[cid];
+  info.error = true;
+  // Keep the first failure, later data is suspect anyway
+  if (!info.tx_failed) {
+    info.tx_failed = true;
+    info.tx_failed_offset = offset;
+  }
+  queueEvent(GS_EVENT_WRITE_FAILURE, cid);
+}
+
+bool GSCore::queueEvent(EventType type, cid_t cid)
+{
+  if (this->event_queue_len == EVENT_QUEUE_SIZE) {
+    // Keep the oldest events, so the ones that are dispatched are
+    // still in order
+    if (GS_LOG_ERRORS && this->error)
+      this->error->println("Event queue is full, dropped event");
+    this->events_lost++;
+    return false;
+  }
+
+  uint8_t index = (this->event_queue_head + this->event_queue_len) % EVENT_QUEUE_SIZE;
+  this->event_queue[index].type = type;
+  this->event_queue[index].cid = cid;
+  this->event_queue[index].time = micros();
+  this->event_generation[index] = cid <= MAX_CID ? this->cid_generation[cid] : 0;
+  this->event_queue_len++;
+  return true;
+}
+
+void GSCore::setCidHandler(cid_t cid, cid_handler_t handler, void *data)
+{
+  if (cid > MAX_CID)
+    return;
+  this->cid_handlers[cid].handler = handler;
+  this->cid_handlers[cid].data = data;
+  this->cid_handlers[cid].generation = this->cid_generation[cid];
+}
+
+uint8_t GSCore::dispatchEvents(unsigned long start, uint32_t budget_us)
+{
+  // Only dispatch the events queued so far, handlers might cause new
+  // events
+  uint8_t count = this->event_queue_len;
+  uint8_t dispatched = 0;
+  while (count--) {
+    // Always dispatch at least one event, so the queue cannot fill up
+    // when incoming data uses up all of the budget
+    if (dispatched && !budget_left(start, budget_us))
+      break;
+    dispatched++;
+
+    Event event = this->event_queue[this->event_queue_head];
+    uint8_t generation = this->event_generation[this->event_queue_head];
+    this->event_queue_head = (this->event_queue_head + 1) % EVENT_QUEUE_SIZE;
+    this->event_queue_len--;
+
+    if (event.type == GS_EVENT_DATA)
+      this->data_events &= ~(1 << event.cid);
+
+    if (this->onEvent)
+      this->onEvent(this->eventData, &event);
+
+    switch (event.type) {
+      case GS_EVENT_ASSOCIATED:
+        if (this->onAssociate)
+          this->onAssociate(this->eventData);
+        break;
+      case GS_EVENT_DISASSOCIATED:
+        if (this->onDisassociate)
+          this->onDisassociate(this->eventData);
+        break;
+      case GS_EVENT_NCM_CONNECTED:
+        if (this->onNcmConnect)
+          this->onNcmConnect(this->eventData, event.cid);
+        break;
+      case GS_EVENT_NCM_DISCONNECTED:
+        if (this->onNcmDisconnect)
+          this->onNcmDisconnect(this->eventData);
+        break;
+      case GS_EVENT_WRITE_FAILURE:
+        if (this->onWriteFailure)
+          this->onWriteFailure(this->eventData, event.cid);
+        break;
+      default:
+        break;
+    }
+
+    // Only pass events to the handler for the same connection, the cid
+    // might have been reused since the event was queued
+    if (event.cid <= MAX_CID && this->cid_handlers[event.cid].handler &&
+        this->cid_handlers[event.cid].generation == generation) {
+      cid_handler_t handler = this->cid_handlers[event.cid].handler;
+      void *data = this->cid_handlers[event.cid].data;
+      // Remove the handler before calling it, so it can set a new
+      // one for a new connection
+      if (event.type == GS_EVENT_DISCONNECTED)
+        this->cid_handlers[event.cid].handler = NULL;
+      handler(data, &event);
+    }
+  }
+  return dispatched;
+}
+
 void GSCore::processConnect(cid_t cid, uint32_t remote_ip, uint16_t remote_port, uint16_t local_port, bool ncm)
 {
   // Did we think this cid is still connected? We must have missed a
@@ -1586,18 +3089,26 @@ void GSCore::processConnect(cid_t cid, uint32_t remote_ip, uint16_t remote_port,
   if (this->connections[cid].connected)
     processDisconnect(cid);
 
+  // Events queued from now on belong to the new connection
+  this->cid_generation[cid]++;
+
   if (ncm) {
     this->ncm_auto_cid = cid;
-    // Keep track of the associated event, even when there is already a
-    // disconnect event (since a reconnect should not go by unnoticed
-    this->events |= EVENT_NCM_CONNECTED;
+    // Apparently, the NCM sets up connections
+    this->ncm_connect = true;
+    queueEvent(GS_EVENT_NCM_CONNECTED, cid);
   }
 
   this->connections[cid].remote_ip = remote_ip;
   this->connections[cid].remote_port = remote_port;
   this->connections[cid].local_port = local_port;
+  this->connections[cid].tx_accepted = 0;
+  this->connections[cid].tx_completed = 0;
+  this->connections[cid].tx_offset = 0;
   this->connections[cid].error = false;
+  this->connections[cid].tx_failed = false;
   this->connections[cid].connected = true;
+  this->disconnected_cids &= ~(1 << cid);
 }
 
 void GSCore::processDisconnect(cid_t cid)
@@ -1607,13 +3118,11 @@ void GSCore::processDisconnect(cid_t cid)
 
   this->connections[cid].connected = false;
   this->connections[cid].ssl = false;
+  this->disconnected_cids |= (1 << cid);
+  queueEvent(GS_EVENT_DISCONNECTED, cid);
   if (cid == this->ncm_auto_cid) {
     this->ncm_auto_cid = INVALID_CID;
-    // If there is still an unprocessed connect event, just cancel that.
-    if (this->events & EVENT_NCM_CONNECTED)
-      this->events &= ~EVENT_NCM_CONNECTED;
-    else
-      this->events |= EVENT_NCM_DISCONNECTED;
+    queueEvent(GS_EVENT_NCM_DISCONNECTED, cid);
   }
 }
 
@@ -57,6 +57,18 @@ const bool GS_DUMP_BYTES = false;
 // received.
 const bool GS_DUMP_SPI = false;
 
+// The sizes of some buffers can be changed at compile time (e.g. by
+// passing -DGS_TX_QUEUE_SIZE=64 to the compiler), to save RAM on small
+// boards. See GSCore::EVENT_QUEUE_SIZE and GSCore::TX_QUEUE_SIZE for
+// what they do.
+#ifndef GS_EVENT_QUEUE_SIZE
+#define GS_EVENT_QUEUE_SIZE 32
+#endif
+
+#ifndef GS_TX_QUEUE_SIZE
+#define GS_TX_QUEUE_SIZE 256
+#endif
+
 /**
  * This class allows talking to a Gainspan Serial2Wifi module. It's
  * intended for the GS1011MIPS module, but might also work with other
@@ -87,11 +99,72 @@ public:
 
   /**
    * How many milliseconds to wait for a a response? Should be fairly
-   * big, since the AT+WA command might take quite a bit of time
-   * TODO: Allow different timeouts per command?
+   * big, since the AT+WA command might take quite a bit of time.
+   *
+   * This is used for data frame replies and for commands with an
+   * unpredictable response time, see TimeoutClass.
    */
   static const unsigned long RESPONSE_TIMEOUT = 20 * 1000;
 
+  /**
+   * Commands are divided into classes with similar response times. For
+   * each class, the expected response time is derived from the
+   * response times seen so far (see getTimeout). Replies that take
+   * longer are logged as slow.
+   *
+   * A reply that takes longer than the class timeout is considered
+   * lost. For GS_TIMEOUT_LOCAL and GS_TIMEOUT_NETWORK, which only
+   * involve the module itself, the command then fails with
+   * GS_RESPONSE_TIMEOUT and the reply is dropped should it still arrive
+   * (see syncTx). For the other classes, a lost reply leaves the module
+   * in an unknown state, so it is an unrecoverable error.
+   */
+  enum TimeoutClass {
+    /** Commands that only change local settings (e.g. ATE0, AT+WSEC) */
+    GS_TIMEOUT_LOCAL,
+    /** Commands that change local network state (e.g. AT+NCLOSE, AT+NDHCP) */
+    GS_TIMEOUT_NETWORK,
+    /** Associating to a wireless network (AT+WA) */
+    GS_TIMEOUT_ASSOCIATE,
+    /** Scanning a channel for networks (AT+WS) */
+    GS_TIMEOUT_SCAN,
+    /** Commands that wait for a remote host (e.g. TCP connect, DNS, NTP, TLS) */
+    GS_TIMEOUT_REMOTE,
+    /**
+     * Commands with an unknown or unpredictable response time (e.g.
+     * sent through writeCommand, computing a WPA PSK, writing to flash
+     * or loading a profile). Uses RESPONSE_TIMEOUT, not adaptive.
+     */
+    GS_TIMEOUT_OTHER,
+
+    GS_TIMEOUT_CLASS_COUNT,
+  };
+
+  /**
+   * Returns the time in which a reply to the given class of commands
+   * is expected, in milliseconds. See TimeoutClass for how this is
+   * used.
+   */
+  unsigned long getTimeout(TimeoutClass cls);
+
+  /**
+   * Fix the timeout for the given class of commands. Pass 0 to go back
+   * to adaptive timeouts.
+   */
+  void setTimeout(TimeoutClass cls, uint16_t ms)
+  {
+    this->timeouts[cls].fixed = ms;
+  }
+
+  /**
+   * Returns the smoothed response time seen for the given class of
+   * commands, in milliseconds, or 0 when no responses were seen yet.
+   */
+  uint16_t getResponseTime(TimeoutClass cls)
+  {
+    return this->timeouts[cls].samples ? this->timeouts[cls].srtt : 0;
+  }
+
   /**
    * A buffer of this size should fit every line of data in a response.
    * Since it's data, it's hard to predict how much is needed, but it's
@@ -101,10 +174,92 @@ public:
    */
   static const uint8_t MAX_DATA_LINE_SIZE = 128;
 
+  /**
+   * The maximum amount of data in a single bulk data frame. The
+   * hardware doesn't support more, according to SERIAL-TO-WIFI ADAPTER
+   * APPLICATION PROGRAMMING GUIDE, section 3.4.1 ("Bulk data Tx and Rx")
+   */
+  static const uint16_t MAX_DATA_FRAME_SIZE = 1400;
+
 /*******************************************************
  * Event handlers
  *******************************************************/
 
+  enum EventType {
+    /** The module associated */
+    GS_EVENT_ASSOCIATED,
+    /** The module disassociated */
+    GS_EVENT_DISASSOCIATED,
+    /** The NCM set up a connection (cid is set) */
+    GS_EVENT_NCM_CONNECTED,
+    /** The connection set up by the NCM was closed (cid is set) */
+    GS_EVENT_NCM_DISCONNECTED,
+    /** The NCM gave up setting up a connection (until the next association) */
+    GS_EVENT_NCM_FAILURE,
+    /** A connection was closed, for any reason (cid is set) */
+    GS_EVENT_DISCONNECTED,
+    /** The module reported a socket failure, data was likely lost (cid is set) */
+    GS_EVENT_SOCKET_FAILURE,
+    /**
+     * A pipelined data frame was rejected (cid is set, see
+     * ConnectionInfo::tx_failed_offset)
+     */
+    GS_EVENT_WRITE_FAILURE,
+    /** Received data was dropped because rx_data was full (cid is set) */
+    GS_EVENT_DATA_DROPPED,
+    /** The standby timer expired */
+    GS_EVENT_STANDBY_TIMER,
+    /** The standby alarm triggered */
+    GS_EVENT_STANDBY_ALARM,
+    /** The module woke up from deep sleep */
+    GS_EVENT_DEEP_SLEEP,
+    /** The module rebooted unexpectedly */
+    GS_EVENT_BOOT,
+    /**
+     * A new frame of data arrived (cid is set). Not queued again for
+     * the same cid until this one is dispatched, so there is not an
+     * event for every frame.
+     */
+    GS_EVENT_DATA,
+  };
+
+  struct Event {
+    EventType type;
+    /** The cid the event applies to, or INVALID_CID */
+    cid_t cid;
+    /** micros() when the event was received */
+    uint32_t time;
+  };
+
+  /**
+   * Called for every event, in the order they happened. Events are
+   * collected while processing data from the module and dispatched
+   * from loop(). The more specific handlers below are called for their
+   * events after this one.
+   */
+  void (*onEvent)(void *data, const Event *event) = NULL;
+
+  typedef void (*cid_handler_t)(void *data, const Event *event);
+
+  /**
+   * Set a handler for the events for a single cid (e.g.
+   * GS_EVENT_DATA, GS_EVENT_DISCONNECTED and GS_EVENT_SOCKET_FAILURE),
+   * called after the other handlers. This allows handling multiple
+   * connections without polling each of them.
+   *
+   * The handler belongs to the connection using the cid when it is
+   * set: it only receives the events for that connection and is
+   * removed automatically when the GS_EVENT_DISCONNECTED event for
+   * that connection is dispatched. When the cid is reused for another
+   * connection before that, a handler set for the new connection does
+   * not receive the events of the old one.
+   *
+   * @param cid      The cid to set the handler for.
+   * @param handler  The handler, or NULL to remove the handler.
+   * @param data     Passed to the handler.
+   */
+  void setCidHandler(cid_t cid, cid_handler_t handler, void *data);
+
   /** Called when the NCM has set up a connection. */
   void (*onNcmConnect)(void *data, cid_t cid) = NULL;
   /** Called when the connection created by the NCM was disconnected (for
@@ -115,10 +270,32 @@ public:
   /** Called when the module disassociates (for any reason, including
    *  explicit disassiation). */
   void (*onDisassociate)(void *data) = NULL;
+  /** Called when the module rejected a data frame written while
+   *  pipelining is enabled (see setTxPipelining and
+   *  ConnectionInfo::tx_failed_offset). */
+  void (*onWriteFailure)(void *data, cid_t cid) = NULL;
 
   /** Data passed to all event handlers */
   void *eventData = NULL;
 
+  /**
+   * Returns the number of events that were lost because the event
+   * queue was full, since begin(). When this happens, loop() should
+   * probably be called more often.
+   */
+  uint16_t getLostEvents() { return this->events_lost; }
+
+  /**
+   * The maximum number of events waiting to be dispatched. There is at
+   * most one GS_EVENT_DATA event for each cid in the queue, so the
+   * default of 2 * (MAX_CID + 1) leaves the same amount of room for
+   * other events. A smaller queue (see GS_EVENT_QUEUE_SIZE) saves RAM
+   * when only a few connections are used. Events that do not fit are
+   * counted by getLostEvents(), a GS_EVENT_DATA event is queued again
+   * with the next frame.
+   */
+  static const uint8_t EVENT_QUEUE_SIZE = GS_EVENT_QUEUE_SIZE;
+
   /**
    * Did an unrecoverable error occur? If this is true, the module stops
    * working and should be reset or powercycled.
@@ -182,12 +359,130 @@ public:
    */
   void loop();
 
+  /** Statistics about a single call to loop(budget_us, stats) */
+  struct LoopStats {
+    /** The number of bytes read from the module and processed */
+    uint16_t bytes_processed;
+    /** The number of events dispatched to the event handlers */
+    uint8_t events_dispatched;
+    /**
+     * True when reading from the module was stopped because the budget
+     * was used up, so more incoming data might be waiting.
+     */
+    bool rx_pending : 1;
+    /**
+     * True when the reply to the pending asynchronous command is in,
+     * but completing it was skipped
+     */
+    bool async_pending : 1;
+    /** True when writing the tx queue to the module was skipped */
+    bool tx_skipped : 1;
+    /** True when the loop handlers were skipped */
+    bool handlers_pending : 1;
+    /** The number of events still queued */
+    uint8_t events_pending;
+    /** The number of bytes still in the tx queue */
+    uint16_t tx_pending;
+  };
+
+  /**
+   * Like loop(), but stop processing once budget_us microseconds have
+   * passed. This makes the time spent in loop() more predictable, e.g.
+   * when it has to share the CPU with time-critical code.
+   *
+   * The budget is checked between bytes and between events, so a
+   * single step (e.g. reading one byte over SPI, or an event handler)
+   * can still overrun it. To guarantee progress, at least one byte is
+   * read and one event is dispatched on every call. Completing an
+   * asynchronous command (which might send a followup command),
+   * writing the tx queue and calling the loop handlers only happen
+   * when there is budget left.
+   *
+   * @param budget_us  The time budget in microseconds. 0 means no
+   *                   limit, which is the same as loop().
+   * @param stats      If not NULL, statistics about the work done and
+   *                   still pending are stored here.
+   *
+   * @returns true when no work was left pending.
+   */
+  bool loop(uint32_t budget_us, LoopStats *stats = NULL);
+
   /**
    * Set the target for error and debug output. Pass NULL to disable
    * (which is also the default).
    */
   void setLogOutput(Print *error, Print *debug) { this->error = error; this->debug = debug; }
 
+  /**
+   * Enable or disable warm starts. Should be called before begin().
+   *
+   * When enabled, begin() first checks if the module is already
+   * running (e.g. when only the Arduino was reset). If so, it does not
+   * wait for the startup banner and, after setting up the modes it
+   * needs, queries the module for its association state and open
+   * connections, instead of assuming it is disassociated without any
+   * connections. No events are generated for the associations and
+   * connections found this way.
+   *
+   * The NCM connection cannot be identified with certainty. When the
+   * NCM is known to set up a connection and exactly one client
+   * connection is open, it is assumed to be the NCM connection.
+   *
+   * @param ncm_connect  Pass true when the NCM is configured (e.g. in
+   *                     the stored profile) to set up a connection.
+   *                     This is also assumed when setNcm() enabled
+   *                     it earlier.
+   */
+  void setWarmStart(bool enable, bool ncm_connect = false)
+  {
+    this->warm_start = enable;
+    this->ncm_connect = this->ncm_connect || ncm_connect;
+  }
+
+  /**
+   * How long to wait for a reply when checking if the module is
+   * running during a warm start, in milliseconds.
+   */
+  static const unsigned long WARM_START_TIMEOUT = 200;
+
+  /**
+   * Base class for objects that need to do some periodic work from
+   * loop() (e.g., GSClient flushing its transmit buffer). Register them
+   * using addLoopHandler.
+   */
+  class LoopHandler {
+    public:
+      LoopHandler() { }
+      virtual ~LoopHandler() { }
+
+      /** Called from GSCore::loop() while registered. */
+      virtual void loop() = 0;
+
+      // A copy of a registered handler would share its place in the
+      // handler list (and, e.g. for GSClient, its buffered data), so
+      // handlers cannot be copied.
+      LoopHandler(const LoopHandler&) = delete;
+      LoopHandler& operator=(const LoopHandler&) = delete;
+
+    protected:
+      friend class GSCore;
+      LoopHandler *next_handler = NULL;
+      bool registered = false;
+  };
+
+  /**
+   * Have the loop() method of the given handler called from loop().
+   * Does nothing when the handler is already registered.
+   */
+  void addLoopHandler(LoopHandler *handler);
+
+  /**
+   * Stop calling the given handler from loop(). Does nothing when the
+   * handler is not registered. Can be safely called from within the
+   * handler's loop() method.
+   */
+  void removeLoopHandler(LoopHandler *handler);
+
 /*******************************************************
  * Methods for reading and writing data
  *******************************************************/
@@ -278,6 +573,38 @@ public:
    */
   cid_t firstCidWithData();
 
+  /**
+   * @returns a bitmask (bit n for cid n) of the cids for which data has
+   * been received (or at least a frame header, the data itself might
+   * still be on its way).
+   */
+  uint16_t cidsWithData();
+
+  /**
+   * Wait until one of the given cids becomes ready, similar to the
+   * POSIX poll() function. While waiting, loop() is called, so event
+   * handlers and loop handlers might run.
+   *
+   * A cid is readable when data was received for it (see
+   * cidsWithData()), or when its connection went down (so the
+   * application notices the disconnect the next time it reads). A cid
+   * that was never connected, e.g. while connectAsync() is still
+   * pending, is not readable. A cid
+   * is writable when it is connected and there is room for
+   * writeDataAsync() for that cid (see availableForWrite(cid_t)).
+   *
+   * @param readable    On entry, a bitmask (bit n for cid n) of the cids
+   *                    to check for reading. On return, the cids that
+   *                    are readable. Can be NULL.
+   * @param writable    On entry, the cids to check for writing. On
+   *                    return, the cids that are writable. Can be NULL.
+   * @param timeout_ms  The maximum time to wait. When 0, return the
+   *                    current state without waiting.
+   *
+   * @returns true when at least one cid is ready.
+   */
+  bool poll(uint16_t *readable, uint16_t *writable, uint16_t timeout_ms);
+
   /**
    * Return the number of bytes that can be read without blocking.
    *
@@ -297,7 +624,9 @@ public:
    * @param buf    The data to send.
    * @param len    The number of bytes to send.
    *
-   * @returns whether the data could be succesfully written.
+   * @returns whether the data could be succesfully written. When
+   *          pipelining is enabled, this only means the data was sent,
+   *          see setTxPipelining.
    */
   bool writeData(cid_t cid, const uint8_t *buf, uint16_t len);
 
@@ -315,6 +644,171 @@ public:
    */
   bool writeData(cid_t cid, IPAddress ip, uint16_t port, const uint8_t *buf, uint16_t len);
 
+  /**
+   * Callback that supplies data for writeStream. It should store up to
+   * len bytes into buf and return the number of bytes stored. Returning
+   * 0 means no more data is available.
+   */
+  typedef uint16_t (*data_producer_t)(uint8_t *buf, uint16_t len, void *data);
+
+  /**
+   * Write a (possibly big) amount of connection data for the given cid,
+   * pulling the data from a callback as it is needed. The data is sent
+   * in bulk data frames of up to MAX_DATA_FRAME_SIZE bytes, but only a
+   * small part of a frame is kept in RAM at any time.
+   *
+   * Since the frame header promises a number of bytes to the module,
+   * the frame is padded with zeroes when the producer runs out of data
+   * early. writeStream then returns false.
+   *
+   * @param cid       The cid to write data to. Can be an invalid cid,
+   *                  will return false then.
+   * @param len       The total number of bytes to send.
+   * @param producer  The callback that supplies the data.
+   * @param data      Passed to the producer unmodified.
+   *
+   * @returns whether all data could be succesfully written.
+   */
+  bool writeStream(cid_t cid, uint32_t len, data_producer_t producer, void *data);
+
+  /**
+   * Write len bytes read from the given stream. This uses
+   * Stream::readBytes, so the stream's timeout applies when not enough
+   * data is available right away.
+   */
+  bool writeStream(cid_t cid, uint32_t len, Stream &stream);
+
+  /**
+   * Write connection data stored in program memory (PROGMEM), without
+   * copying all of it to RAM first. Bigger buffers are split into
+   * multiple frames, like writeData does.
+   */
+  bool writeData_P(cid_t cid, const uint8_t *buf, uint32_t len);
+
+  /**
+   * Queue connection data for the given cid, to be written to the
+   * module from loop() without blocking. Frames are sent like with
+   * pipelining enabled (see setTxPipelining), so failures are reported
+   * through onWriteFailure. While the reply to an asynchronous or
+   * batched command is pending, queued frames wait for it, or are
+   * sent without pipelining when something else needs the queue to be
+   * empty (e.g. sending a command).
+   *
+   * Queued data is always sent before data written through
+   * writeData, writeStream or writeDataBatch, so these can be mixed
+   * freely.
+   *
+   * @param cid    The cid to write data to. Can be an invalid cid, will
+   *               return 0 then.
+   * @param buf    The data to send.
+   * @param len    The number of bytes to send.
+   *
+   * @returns the number of bytes queued. This is either len, or 0 when
+   *          there is not enough room (see availableForWrite).
+   */
+  uint16_t writeDataAsync(cid_t cid, const uint8_t *buf, uint16_t len);
+
+  /**
+   * Returns the number of bytes that can be queued in a single call,
+   * leaving aside the per-cid limit (see availableForWrite(cid_t)).
+   */
+  uint16_t availableForWrite();
+
+  /**
+   * Returns the number of bytes that can be passed to writeDataAsync
+   * for the given cid in a single call. A single cid can only use part
+   * of the queue (TX_QUEUE_CID_LIMIT), so other cids can still queue
+   * data while it has a lot of data pending.
+   */
+  uint16_t availableForWrite(cid_t cid);
+
+  /**
+   * Write queued data to the module.
+   *
+   * @param block   When false, stop as soon as the module cannot accept
+   *                more data, instead of waiting for it.
+   *
+   * @returns true when all queued data was written.
+   */
+  bool drainTxQueue(bool block);
+
+  struct TXFrame {
+    /* Destination IP address, for UDP server cids only */
+    IPAddress ip;
+    /* Destination port, for UDP server cids only. When 0, the frame is
+     * sent to the fixed destination of the cid instead (e.g., for TCP or
+     * UDP client cids). */
+    uint16_t port;
+
+    const uint8_t *buf;
+    uint16_t length;
+
+    /* Set by writeDataBatch: true when the module accepted the frame */
+    bool ok;
+  };
+
+  /**
+   * Write a number of frames for the given cid back to back.
+   *
+   * Unlike writeData, this does not wait for the module to acknowledge
+   * each frame before sending the next one. Instead, up to
+   * MAX_TX_PENDING frames are sent ahead, and the replies are collected
+   * as they come in. The destination part of the frame header is only
+   * formatted again when it differs from the previous frame.
+   *
+   * When the module rejects a frame, the rest of that frame has already
+   * been sent, which the module interprets as a (garbage) command. The
+   * replies to that are dropped before sending the next frame (see
+   * resyncTx), which stalls the batch for at least RESYNC_QUIET_TIME.
+   *
+   * @param cid    The cid to write data to. Can be an invalid cid, all
+   *               frames will fail then.
+   * @param frames The frames to send. The ok field of every frame is
+   *               set to indicate whether it was accepted. Frames
+   *               longer than 1400 bytes are not sent at all.
+   * @param count  The number of frames.
+   *
+   * @returns the number of frames succesfully written.
+   */
+  uint8_t writeDataBatch(cid_t cid, TXFrame *frames, uint8_t count);
+
+  /**
+   * The maximum number of data frames that can be sent without having
+   * seen the module's reply for them.
+   */
+  static const uint8_t MAX_TX_PENDING = 8;
+
+  /**
+   * Enable or disable pipelining for writeData (without ip and port).
+   *
+   * Normally, writeData sends the start of the frame header and then
+   * waits for the module to accept the frame before sending the rest.
+   * With pipelining enabled, the entire frame is sent right away and
+   * the module's reply is handled later, while sending the next frames
+   * or from loop(). When a frame turns out to be rejected, the error
+   * flag for the cid is set and the onWriteFailure handler is called.
+   * The GS_EVENT_WRITE_FAILURE event tells which frame was rejected.
+   *
+   * When the module rejects a frame, the rest of that frame has already
+   * been sent, which the module interprets as a (garbage) command. The
+   * replies to that are dropped before the next command or pipelined
+   * frame is sent (see resyncTx), which stalls the writer for at least
+   * RESYNC_QUIET_TIME. While the reply to an asynchronous or batched
+   * command is pending, frames are not pipelined.
+   *
+   * @param depth   The number of frames that can be sent before
+   *                waiting for a reply (capped at MAX_TX_PENDING). Pass
+   *                0 to disable pipelining (the default).
+   */
+  void setTxPipelining(uint8_t depth);
+
+  /**
+   * Wait until the module has replied to all data frames sent so far.
+   *
+   * @returns false when no reply was received in time, true otherwise.
+   */
+  bool flushData();
+
 /*******************************************************
  * Methods for getting connection info
  *******************************************************/
@@ -330,12 +824,35 @@ public:
      * open, but it is probably best to close it and try again.
      */
     bool error : 1;
+    /**
+     * When true, the module rejected a data frame for this connection
+     * (see GS_EVENT_WRITE_FAILURE and tx_failed_offset).
+     */
+    bool tx_failed : 1;
     /** Remote IP. 0 means unknown */
     uint32_t remote_ip;
     /** Local port number. 0 means unknown. */
     uint16_t local_port;
     /** Remote port number. 0 means unknown. */
     uint16_t remote_port;
+    /** Bytes queued through writeDataAsync since the connection opened */
+    uint32_t tx_accepted;
+    /**
+     * Bytes from tx_accepted that were actually written to the module.
+     * The difference with tx_accepted is still in the queue.
+     */
+    uint32_t tx_completed;
+    /**
+     * Bytes in the data frames started for this connection since it
+     * opened, by any of the write functions.
+     */
+    uint32_t tx_offset;
+    /**
+     * When tx_failed is set: the tx_offset of the first byte of the
+     * first rejected frame, so the caller can tell which write failed.
+     * Any data written after that might be lost too.
+     */
+    uint32_t tx_failed_offset;
   };
 
   /**
@@ -348,6 +865,17 @@ public:
     return this->connections[cid];
   }
 
+  /**
+   * Returns a number that changes whenever the given cid is used for a
+   * new connection, so a cid that was stored earlier can be checked to
+   * still refer to the same connection. Only valid cids should be
+   * passed.
+   */
+  uint8_t getCidGeneration(cid_t cid)
+  {
+    return this->cid_generation[cid];
+  }
+
   /**
    * Returns the cid of the automatic connection set up by the network
    * connection manager.
@@ -373,6 +901,49 @@ public:
     return this->associated;
   }
 
+  /**
+   * Like getConnectionInfo(), but return the state as last seen,
+   * without reading anything from the module. Call refreshState() or
+   * loop() regularly to keep it up-to-date.
+   */
+  const ConnectionInfo& getCachedConnectionInfo(cid_t cid)
+  {
+    return this->connections[cid];
+  }
+
+  /**
+   * Like getNcmCid(), but without reading anything from the module.
+   */
+  cid_t getCachedNcmCid()
+  {
+    return this->ncm_auto_cid;
+  }
+
+  /**
+   * Like isAssociated(), but without reading anything from the module.
+   */
+  bool isAssociatedCached()
+  {
+    return this->associated;
+  }
+
+  /**
+   * Process pending async messages from the module, unless that was
+   * already done less than the interval set through
+   * setStateRefreshInterval ago. Use this together with the cached
+   * accessors above to check the state often, without the overhead of
+   * reading from the module every time.
+   */
+  void refreshState();
+
+  /**
+   * Set the minimum time between two refreshes by refreshState(), in
+   * milliseconds. Pass 0 to refresh on every call.
+   */
+  void setStateRefreshInterval(uint16_t ms) { this->state_refresh_interval = ms; }
+
+  static const uint16_t DEFAULT_STATE_REFRESH_INTERVAL = 10;
+
 /*******************************************************
  * Methods for writing commands / reading replies
  *******************************************************/
@@ -411,12 +982,81 @@ public:
     // code to comunicate between different parts of the code.
     GS_UNKNOWN_RESPONSE,
     GS_UNRECOVERABLE_ERROR,
+    /** No reply within the timeout, but the module is still usable */
+    GS_RESPONSE_TIMEOUT,
+  };
+
+  struct AsyncCommand;
+
+  /**
+   * Helper to send a command to the module piece by piece, without
+   * formatting it into a buffer (or using printf) first. Obtain one
+   * through command() and finish it with send() or checkOk(), e.g.:
+   *
+   *    gs.command(F("AT+NCLOSE=")).hex(cid).checkOk();
+   */
+  class Command {
+    public:
+      /** Write a string as-is */
+      Command& str(const char *s);
+      Command& str(const __FlashStringHelper *s);
+      /** Write a single character */
+      Command& chr(char c);
+      /** Write a string surrounded by double quotes */
+      Command& quoted(const char *s);
+      /** Write a number in decimal */
+      Command& num(uint32_t n);
+      /** Write a number in (lowercase) hexadecimal, e.g. a cid */
+      Command& hex(uint32_t n);
+      /** Write an IP address in dotted quad notation */
+      Command& ip(const IPAddress& ip);
+
+      /** Finish the command by sending the line ending */
+      void send();
+
+      /**
+       * Finish the command and read the reply.
+       *
+       * @param on_ok   If not NULL, this is called when the command
+       *                succeeds. In a batch, this happens only when
+       *                the reply is read, so any side effects of the
+       *                command should be applied here.
+       *
+       * @returns true when an OK response was received, false in all
+       *          other cases.
+       */
+      bool checkOk(void (*on_ok)(GSCore &gs) = NULL);
+
+      /**
+       * Finish the command, but don't wait for the reply. Instead, the
+       * reply is processed by GSCore::loop() and reported through the
+       * given AsyncCommand. See AsyncCommand for details.
+       */
+      void sendAsync(AsyncCommand *cmd);
+
+    protected:
+      friend class GSCore;
+      Command(GSCore &gs) : gs(gs) { }
+      GSCore &gs;
   };
 
+  /**
+   * Start sending a command to the module, starting with the given
+   * string (which should not contain the trailing \r\n).
+   *
+   * @param cls    The class of the command, which determines how long
+   *               to wait for the reply.
+   */
+  Command command(const char *start, TimeoutClass cls = GS_TIMEOUT_LOCAL);
+  Command command(const __FlashStringHelper *start, TimeoutClass cls = GS_TIMEOUT_LOCAL);
+
   /**
    * Send a command to the module. Accepts a format string and arguments
    * like printf. The string is sent as-is, so it should contain the
    * trailing \r\n already.
+   *
+   * Note that command() can be used instead to prevent pulling in
+   * printf.
    */
   void writeCommand(const char *fmt, ...);
   void writeCommand(const char *fmt, va_list args);
@@ -444,6 +1084,14 @@ public:
    * Empty lines in the result are ignored, since they are hard to
    * recognize reliably.
    *
+   * When buf fills up, the data already in it is kept, up to and
+   * including the last complete line. The rest of the data is dropped
+   * (and an error is logged), so the returned data is truncated
+   * cleanly instead of having gaps. The reply is still read up to its
+   * final response line, which is recognized from a small tail window
+   * that holds the start of the current line, so filling up buf
+   * never stops the reply from completing.
+   *
    * @param buf            A buffer to store the received data in.
    * @param len            The pointer to the length of the buffer. Will
    *                       be set to the number of bytes written to buf.
@@ -452,8 +1100,8 @@ public:
    *                       numerical cid sent by the module.
    *
    * @returns the code for the response read, or GS_RESPONSE_TIMEOUT
-   *          when no response was read within GS_RESPONSE_TIMEOUT
-   *          milliseconds.
+   *          or GS_UNRECOVERABLE_ERROR when no response was read in
+   *          time (see TimeoutClass).
    */
   GSResponse readResponse(uint8_t *buf, uint16_t *len, cid_t *connect_cid = NULL);
 
@@ -466,8 +1114,8 @@ public:
    *                       numerical cid sent by the module.
    *
    * @returns the code for the response read, or GS_RESPONSE_TIMEOUT
-   *          when no response was read within GS_RESPONSE_TIMEOUT
-   *          milliseconds.
+   *          or GS_UNRECOVERABLE_ERROR when no response was read in
+   *          time (see TimeoutClass).
    */
   GSResponse readResponse(cid_t *connect_cid = NULL);
 
@@ -488,17 +1136,131 @@ public:
    *                       is then not passed to the callback.
    *
    * @returns the code for the response read, or GS_RESPONSE_TIMEOUT
-   *          when no response was read within GS_RESPONSE_TIMEOUT
-   *          milliseconds.
+   *          or GS_UNRECOVERABLE_ERROR when no response was read in
+   *          time (see TimeoutClass).
    *
    * Within the callback, no new commands should be sent to the module,
    * since that will cause deadlocks and/or other unexpected behaviour.
    *
    * The callback should be prepared to process lines up to
-   * MAX_DATA_LINE_SIZE in length.
+   * MAX_DATA_LINE_SIZE in length. Each line is collected in full
+   * before it is passed to the callback, so the callback never sees a
+   * partial line. Lines that are longer are dropped (and an error is
+   * logged) and never passed to the callback, but the reply is still
+   * read up to its final response line, just like with the buffer
+   * version above.
    */
   GSResponse readResponse(line_callback_t callback, void *data, cid_t *connect_cid = NULL);
 
+  /**
+   * Keeps track of a command sent with Command::sendAsync. The caller
+   * should allocate one and keep it around until the command completes.
+   * Either set onComplete, or poll the pending field (while calling
+   * loop()) to find out when the command is done.
+   *
+   * Only one command can be waiting for its reply at a time. When a new
+   * command is sent (synchronous or not) while an asynchronous command
+   * is still pending, the new command blocks until the pending command
+   * completes. Connection data can still be sent and received while a
+   * command is pending.
+   */
+  struct AsyncCommand {
+    /** True while the command is waiting for its reply */
+    bool pending = false;
+    /** The final response code. Valid once pending is false. */
+    GSResponse response = GS_UNKNOWN_RESPONSE;
+    /**
+     * The cid from a "CONNECT <cid>" reply, or the cid the command
+     * applies to (depending on the command).
+     */
+    cid_t cid = INVALID_CID;
+    /** Result or argument, depending on the command */
+    IPAddress ip;
+    /** Result or argument, depending on the command */
+    uint16_t port = 0;
+    /** Result or argument, depending on the command */
+    uint32_t arg = 0;
+
+    /**
+     * If set, this is called for every line of data in the reply.
+     * Should be set before the command is sent.
+     */
+    line_callback_t line_callback = NULL;
+    void *line_data = NULL;
+
+    /**
+     * If set, this is called when the reply is complete, before the
+     * command is marked as no longer pending. Used internally to
+     * process the result of a command.
+     *
+     * This can send another command using sendAsync with the same
+     * AsyncCommand and return false to keep the command pending until
+     * that reply is in as well.
+     */
+    bool (*finish)(GSCore &gs, AsyncCommand *cmd) = NULL;
+
+    /** If set, this is called when the command is complete. */
+    void (*onComplete)(void *data, AsyncCommand *cmd) = NULL;
+    /** Passed to onComplete */
+    void *data = NULL;
+  };
+
+  /**
+   * Returns true when an asynchronous command is waiting for its reply.
+   */
+  bool asyncCommandPending() { return this->async_command != NULL; }
+
+  /**
+   * Wait until the pending asynchronous command (if any) completes.
+   *
+   * @returns false when an unrecoverable error occured, true
+   *          otherwise.
+   */
+  bool waitAsyncCommand();
+
+  /**
+   * Start a batch of commands. Until endBatch() is called, commands
+   * finished with Command::checkOk() (which includes most GSModule
+   * setters, like setSecurity() or setDhcp()) are sent without waiting
+   * for their reply and checkOk() returns true. The replies are read
+   * in order afterwards, saving a roundtrip for every command. To
+   * prevent overflowing the module's buffers, at most
+   * MAX_BATCH_PENDING commands are sent ahead of their replies.
+   *
+   * Anything that needs the reply to a command (getters, asynchronous
+   * commands) first reads all outstanding replies, so these can be
+   * used in a batch, but lose the benefit. Sending or receiving data
+   * is not allowed during a batch. Calling loop() (or anything else
+   * that processes incoming data) first reads all outstanding replies,
+   * so these are not mistaken for asynchronous data.
+   *
+   * @param results   If not NULL, the response to each command in the
+   *                  batch is stored here, in order.
+   * @param size      The maximum number of commands in the batch (and
+   *                  the size of results). Any commands beyond this are
+   *                  not batched, but sent normally.
+   */
+  void beginBatch(GSResponse *results, uint8_t size);
+
+  /**
+   * Read the replies to all commands in the batch and end the batch.
+   *
+   * @returns true when all commands in the batch succeeded, false
+   *          otherwise.
+   */
+  bool endBatch();
+
+  /**
+   * Returns true while a batch of commands is active.
+   */
+  bool batchActive() { return this->batch.active; }
+
+  /**
+   * The maximum number of batched commands sent without reading their
+   * replies.
+   */
+  static const uint8_t MAX_BATCH_PENDING = 4;
+
   /**
    * Read a single data response (e.g. <Esc>O or <Esc>F in response to a
    * data transmission escape sequence).
@@ -513,8 +1275,16 @@ public:
    *
    * You should not normally use this method, instead use either
    * writeCommand() or writeData().
+   *
+   * @returns the number of bytes written. This is less than len when
+   *          the module did not accept the data within a timeout.
+   */
+  uint16_t writeRaw(const uint8_t *buf, uint16_t len);
+
+  /**
+   * Write a raw sequence of bytes stored in program memory (PROGMEM).
    */
-  void writeRaw(const uint8_t *buf, uint16_t len);
+  void writeRaw_P(const uint8_t *buf, uint16_t len);
 
   /**
    * Reads a single byte from the module, or returns -1 when no byte is available.
@@ -541,6 +1311,35 @@ public:
    */
   static bool parseIpAddress(IPAddress *ip, const char *str, uint16_t len = 0);
 
+  /**
+   * Formats a number into a string, without using printf.
+   *
+   * @param buf        The buffer to write to, must have room for the
+   *                   biggest number in the given base (32 characters
+   *                   for base 2, 11 for base 8, 10 for base 10, 8 for
+   *                   base 16), or min_digits, if bigger. No trailing
+   *                   \0 is written.
+   * @param n          The number to format.
+   * @param base       The base to use, 2 to 16 (inclusive). Letters are
+   *                   lowercase. Other values are treated as 10.
+   * @param min_digits The number is padded with zeroes to be at least
+   *                   this many digits.
+   *
+   * @returns the number of characters written.
+   */
+  static uint8_t formatNumber(uint8_t *buf, uint32_t n, uint8_t base = 10, uint8_t min_digits = 1);
+
+  /**
+   * Formats an IP address in dotted quad notation, without using
+   * printf.
+   *
+   * @param buf    The buffer to write to, must have room for at least
+   *               15 characters. No trailing \0 is written.
+   *
+   * @returns the number of characters written.
+   */
+  static uint8_t formatIpAddress(uint8_t *buf, const IPAddress& ip);
+
 /*******************************************************
  * Internal helper methods
  *******************************************************/
@@ -608,11 +1407,20 @@ protected:
    */
   void bufferFrameHeader(const RXFrame *frame);
 
+  /** An offset into rx_data */
+  typedef uint16_t rx_data_index_t;
+
   /**
    * Loads a frame header from rx_data. Should not be called when
    * rx_data is empty.
    */
-  void loadFrameHeader(RXFrame *frame);
+  void loadFrameHeader(RXFrame *frame) { loadFrameHeader(frame, &this->rx_data_tail); }
+
+  /**
+   * Loads the frame header buffered at *pos in rx_data and advances
+   * *pos past it.
+   */
+  void loadFrameHeader(RXFrame *frame, rx_data_index_t *pos);
 
   /**
    * Get the next data byte, without blocking. The frame is loaded
@@ -627,6 +1435,176 @@ protected:
    */
   void readAndProcessAsync();
 
+  /**
+   * Read and process any async responses available, until budget_us
+   * microseconds have passed since start (or without a time limit when
+   * budget_us is 0).
+   *
+   * @param more  Set to true when processing stopped early because
+   *              the budget was used up, false otherwise.
+   *
+   * @returns the number of bytes processed.
+   */
+  uint16_t readAndProcessAsync(unsigned long start, uint32_t budget_us, bool *more);
+
+  /**
+   * Should be called when an <ESC>O or <ESC>F reply to a data frame is
+   * received. Handles the reply for a pipelined frame, or stores it in
+   * tx_replies to be picked up by readDataResponse.
+   */
+  void processDataResponse(bool ok);
+
+  /**
+   * Register a data frame for the given cid as sent. Callers should
+   * make sure that fewer than MAX_TX_PENDING frames are pending.
+   *
+   * @param flags     TX_PENDING_DEFERRED when the reply is handled by
+   *                  processDataResponse instead of readDataResponse,
+   *                  plus TX_PENDING_EARLY when the payload is sent
+   *                  without waiting for the reply.
+   * @param len       The number of data bytes in the frame.
+   */
+  void addTxPending(cid_t cid, uint8_t flags, uint16_t len);
+
+  /**
+   * Make sure no data frame replies are outstanding and, when the
+   * payload of a rejected frame ended up at the command interpreter,
+   * get the module back in sync (see resyncTx). When a command reply
+   * timed out before, drop it in case it still arrives. Should be
+   * called before sending a command.
+   *
+   * @returns false when the module could not be brought back in sync,
+   *          after flagging an unrecoverable error.
+   */
+  bool syncTx();
+
+  /**
+   * Recover from a frame that was rejected after its payload was
+   * already sent: the module passed that payload to its command
+   * interpreter, so its replies must be dropped before the next
+   * command, or they would be taken for the reply to that command.
+   * This waits for the replies to all frames in flight, terminates any
+   * partial command line and then drops replies until the module is
+   * quiet for RESYNC_QUIET_TIME.
+   *
+   * @returns false when the module kept sending replies for
+   *          RESPONSE_TIMEOUT, after flagging an unrecoverable error.
+   */
+  bool resyncTx();
+
+  /**
+   * Read and process incoming data, dropping any replies, until the
+   * module sent no replies for quiet milliseconds.
+   *
+   * @returns false when the module was not quiet within
+   *          RESPONSE_TIMEOUT (on top of quiet), after flagging an
+   *          unrecoverable error.
+   */
+  bool dropReplies(unsigned long quiet);
+
+  /**
+   * The time (in milliseconds) the module must be quiet before resyncTx
+   * considers it back in sync.
+   */
+  static const unsigned long RESYNC_QUIET_TIME = 100;
+
+  /**
+   * Is the reply to an asynchronous or batched command still expected?
+   * Frames are only sent early (see TX_PENDING_EARLY) when not, since
+   * the replies to the payload of a rejected frame would otherwise be
+   * taken for the command reply.
+   */
+  bool commandReplyPending()
+  {
+    return this->async_command || (this->batch.active && this->batch.read != this->batch.sent);
+  }
+
+  /**
+   * Formats the destination for a UDP server frame header
+   * ("<ip>:<port>:") into buf. The buffer should be at least
+   * MAX_FRAME_DEST_SIZE long.
+   *
+   * @returns the number of characters written.
+   */
+  static uint8_t formatFrameDestination(uint8_t *buf, const IPAddress& ip, uint16_t port);
+
+  /**
+   * Formats the header for a data frame into buf. The buffer should be
+   * at least MAX_FRAME_HEADER_SIZE long.
+   *
+   * @param dest      The destination formatted by
+   *                  formatFrameDestination for UDP server frames, or
+   *                  NULL for other frames.
+   * @param dest_len  The length of dest.
+   *
+   * @returns the number of characters written. The first 3 are the
+   *          escape sequence up to the cid.
+   */
+  static uint8_t formatFrameHeader(uint8_t *buf, cid_t cid, const uint8_t *dest, uint8_t dest_len, uint16_t len);
+
+  /**
+   * Start a bulk data frame for the given cid. When this returns true,
+   * exactly len bytes of data should be written using writeRaw.
+   */
+  bool beginDataFrame(cid_t cid, uint16_t len);
+
+  /**
+   * The number of bytes writeStream gets from its producer at a time.
+   */
+  static const uint8_t STREAM_CHUNK_SIZE = 32;
+
+  /**
+   * The size of the queue for writeDataAsync. Each frame takes
+   * TX_QUEUE_FRAME_OVERHEAD bytes on top of its data, so this fits
+   * three full GSClient transmit buffers. Anything that does not fit
+   * is written synchronously through writeData instead, so a bigger
+   * queue mostly costs RAM, which is scarce on the AVR boards this
+   * library targets (see GS_TX_QUEUE_SIZE to change it).
+   */
+  static const uint16_t TX_QUEUE_SIZE = GS_TX_QUEUE_SIZE;
+
+  /** Bytes stored in tx_queue before the data of each frame */
+  static const uint8_t TX_QUEUE_FRAME_OVERHEAD = 3;
+
+  /**
+   * The number of data bytes a single cid can have in tx_queue, see
+   * availableForWrite(cid_t).
+   */
+  static const uint16_t TX_QUEUE_CID_LIMIT = TX_QUEUE_SIZE / 2;
+
+  /**
+   * Write a raw sequence of bytes, without first finishing a queued
+   * frame that was partially written.
+   *
+   * @param block   When false, stop when the module cannot accept more
+   *                data (SPI XOFF), instead of waiting for it.
+   *
+   * @returns the number of bytes written.
+   */
+  uint16_t writeRawInternal(const uint8_t *buf, uint16_t len, bool block);
+
+  /** Remove the oldest frame, with len bytes of data, from tx_queue */
+  void popTxQueue(uint16_t len);
+
+  /** Read a byte from tx_queue, offset bytes after its tail */
+  uint8_t peekTxQueue(uint16_t offset)
+  {
+    return this->tx_queue[(this->tx_queue_tail + offset) % TX_QUEUE_SIZE];
+  }
+
+  /**
+   * Write part of a command line and dump it to the debug output.
+   */
+  void writeCommandPart(const uint8_t *buf, uint16_t len);
+
+  /**
+   * Read and process incoming data until no more than max_pending data
+   * frames are waiting for a reply.
+   *
+   * @returns false when no reply was received in time, true otherwise.
+   */
+  bool waitTxPending(uint8_t max_pending);
+
   /**
    * Drop a byte from the tail of rx_data, to make room for incoming
    * data and mark the affected cid as broken.
@@ -643,8 +1621,9 @@ protected:
    *
    * When keep_data is true and a callback is given, the callback is called for every line of
    * non-response data and the data is then discarded. The buffer
-   * passed is only used for temporary storage and should be exactly
-   * MAX_DATA_LINE_SIZE long.
+   * passed is only used to collect the current line and should be
+   * exactly MAX_DATA_LINE_SIZE long. Lines are not streamed to the
+   * callback in parts, since all callbacks parse complete lines.
    *
    * When keep_data is true and no callback is given, any non-response
    * data read is put into the buffer and *len is set to the total
@@ -654,6 +1633,169 @@ protected:
    */
   GSResponse readResponseInternal(uint8_t *buf, uint16_t *len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data);
 
+  /**
+   * Start reading a reply. The reply is read from processIncoming() by
+   * calling processResponseByte for every byte that is not part of
+   * connection data or an asynchronous message. Until then,
+   * response.done is false.
+   *
+   * @see readResponseInternal for the parameters.
+   */
+  void startResponse(uint8_t *buf, uint16_t len, cid_t *connect_cid, bool keep_data, line_callback_t callback, void *data);
+
+  /**
+   * Process a single byte of a reply started using startResponse().
+   * Takes constant time per byte, also when the buffer is full.
+   */
+  void processResponseByte(uint8_t c);
+
+  /**
+   * Update the response time statistics for the given class of
+   * commands.
+   */
+  void processResponseTime(TimeoutClass cls, unsigned long ms);
+
+  /**
+   * The number of responses that should be seen before the timeout is
+   * based on them.
+   */
+  static const uint8_t MIN_TIMEOUT_SAMPLES = 4;
+
+  /**
+   * Register the given command as the pending asynchronous command and
+   * start reading its reply.
+   */
+  void startAsyncCommand(AsyncCommand *cmd);
+
+  /**
+   * Handle a timeout while reading the active response, see
+   * TimeoutClass.
+   *
+   * @returns the result for the response: GS_RESPONSE_TIMEOUT or
+   *          GS_UNRECOVERABLE_ERROR.
+   */
+  GSResponse processResponseTimeout();
+
+  /**
+   * Set the finish function and line callback for an asynchronous
+   * command started by the library, clearing anything left behind when
+   * cmd was used for another command before.
+   */
+  static void prepareAsyncCommand(AsyncCommand *cmd, bool (*finish)(GSCore &gs, AsyncCommand *cmd), line_callback_t line_callback = NULL, void *line_data = NULL)
+  {
+    cmd->finish = finish;
+    cmd->line_callback = line_callback;
+    cmd->line_data = line_data;
+  }
+
+  /**
+   * Complete the pending asynchronous command when its reply is in (or
+   * it timed out).
+   */
+  void processAsyncCommand();
+
+  /**
+   * Add an event to the event queue, to be dispatched from loop().
+   *
+   * @returns false when the queue was full.
+   */
+  bool queueEvent(EventType type, cid_t cid = INVALID_CID);
+
+  /**
+   * Handle a data frame for the given cid that the module rejected,
+   * offset is its ConnectionInfo::tx_offset.
+   */
+  void processWriteFailure(cid_t cid, uint32_t offset);
+
+  /**
+   * Call the event handlers for all events queued so far, until
+   * budget_us microseconds have passed since start (or without a time
+   * limit when budget_us is 0).
+   *
+   * @returns the number of events dispatched.
+   */
+  uint8_t dispatchEvents(unsigned long start, uint32_t budget_us);
+
+  /**
+   * Check if the module is already up and running, by sending a
+   * command and waiting (shortly) for a reply.
+   *
+   * @param seen_data  Set to true when any data was received, even
+   *                   when it was not a valid reply.
+   * @returns true when the module replied succesfully.
+   */
+  bool probeModule(bool *seen_data);
+
+  /**
+   * Query the module for its association state and open connections
+   * and update our state to match.
+   */
+  bool resyncState();
+
+  /** Passed to processCidLine() */
+  struct CidListState {
+    GSCore *gs;
+    /** The last client connection seen */
+    cid_t client;
+    /** The number of client connections seen */
+    uint8_t clients;
+  };
+
+  /* Line callbacks for resyncState() */
+  static void processStatusLine(const uint8_t *buf, uint16_t len, void *data);
+  static void processCidLine(const uint8_t *buf, uint16_t len, void *data);
+
+  /** Field callback for processStatusLine() */
+  static void processStatusField(const uint8_t *key, uint16_t key_len, const uint8_t *value, uint16_t value_len, void *data);
+
+  typedef void (*status_field_callback_t)(const uint8_t *key, uint16_t key_len, const uint8_t *value, uint16_t value_len, void *data);
+
+  /**
+   * Split a line of AT+NSTAT output into its key=value fields and call
+   * the callback for each of them. Quotes around values are removed.
+   * Keys should be matched using statusKeyMatches().
+   */
+  static void parseStatusLine(const uint8_t *buf, uint16_t len, status_field_callback_t callback, void *data);
+
+  /**
+   * Returns true when the given key from parseStatusLine() ends with
+   * the given name, preceded by a space or nothing.
+   */
+  static bool statusKeyMatches(const uint8_t *key, uint16_t len, const char *name);
+
+  /**
+   * Called after sending a command finished with checkOk(). When a
+   * batch is active, records the command as part of the batch.
+   *
+   * @param on_ok   Called by readBatchReply() when the command
+   *                succeeds, may be NULL.
+   *
+   * @returns true when the command was added to the batch, false when
+   *          its reply should be read normally.
+   */
+  bool addBatchCommand(void (*on_ok)(GSCore &gs));
+
+  /**
+   * Read the reply to the oldest unanswered command in the batch.
+   */
+  void readBatchReply();
+
+  /**
+   * Read the replies to all unanswered commands in the batch. The
+   * batch remains active.
+   *
+   * @returns false when an unrecoverable error occured, true
+   *          otherwise.
+   */
+  bool waitBatchReplies();
+
+  /**
+   * Wait until the reply started with startResponse() is complete.
+   *
+   * @returns the response code, or GS_UNRECOVERABLE_ERROR on timeout.
+   */
+  GSResponse waitResponse();
+
   /**
    * Look at the given response line and find out what kind of reponse
    * it is.
@@ -689,6 +1831,9 @@ protected:
    */
   void processDisassociation();
 
+  /** Calls processDisassociation(), for use with Command::checkOk() */
+  static void disassociated(GSCore &gs) { gs.processDisassociation(); }
+
   /**
    * Should be called when we learn a new connection was created. Any
    * values that are unknown should be passed as 0.
@@ -745,6 +1890,15 @@ protected:
   // TODO: How big should this buffer be?
   static const uint16_t RX_DATA_BUF_SIZE = 512;
 
+  /**
+   * The longest destination in a UDP server frame header is
+   * "123.123.123.123:65535:", which is 22 bytes.
+   */
+  static const uint8_t MAX_FRAME_DEST_SIZE = 22;
+
+  /** <ESC>Y<cid><dest><length 4 ascii char> */
+  static const uint8_t MAX_FRAME_HEADER_SIZE = 3 + MAX_FRAME_DEST_SIZE + 4;
+
   /** The serial port to use, in serial mode */
   Stream *serial = NULL;
   /** The slave select pin to use, in SPI mode */
@@ -761,6 +1915,18 @@ protected:
   /** True when inside begin() */
   bool initializing = false;
 
+  /** Should begin() try a warm start? */
+  bool warm_start = false;
+
+  /** Is the NCM known to set up a connection? See setWarmStart() */
+  bool ncm_connect = false;
+
+  /**
+   * Incremented whenever the module (re)boots, or might have, so
+   * subclasses can tell when module state they track is lost.
+   */
+  uint8_t boot_count = 0;
+
   /**
    * When no data_ready pin is available, this is the (lower 16 bits of)
    * the microseconds timestamp when the last poll was done.
@@ -788,13 +1954,96 @@ protected:
   /** The subtype of asynchronous response bein received. */
   uint8_t rx_async_subtype;
 
+  /** The state of the reply currently being read, if any */
+  struct {
+    /**
+     * The buffer to store data in. See readResponseInternal for how it
+     * is used.
+     */
+    uint8_t *buf;
+    /** The size of buf */
+    uint16_t size;
+    /** The number of bytes in buf */
+    uint16_t read;
+    /** The offset into buf where the current line starts */
+    uint16_t line_start;
+    cid_t *connect_cid;
+    line_callback_t callback;
+    void *data;
+    /** millis() when the reply was started */
+    unsigned long start;
+    /** How long to wait for the reply */
+    unsigned long timeout;
+    /** The class of the command this is a reply to */
+    TimeoutClass timeout_class;
+    /** The final response. Valid when done is true. */
+    GSResponse result;
+    /**
+     * When buf is full, the start of the current line, which is enough
+     * to recognize a response.
+     */
+    uint8_t tail[MAX_RESPONSE_SIZE];
+    uint8_t tail_len;
+    bool keep_data : 1;
+    /** Data was dropped because the buffer was full */
+    bool dropped_data : 1;
+    /** Data from the current line was dropped, ignore the line */
+    bool skip_line : 1;
+    /** The current line did not fit in buf and is kept in tail */
+    bool in_tail : 1;
+    /** Are we currently reading a reply? */
+    bool active : 1;
+    /** Is the reply complete? */
+    bool done : 1;
+  } response;
+
+  /** The class of the last command sent */
+  TimeoutClass command_timeout_class = GS_TIMEOUT_OTHER;
+
+  /** Response time statistics for each class of commands */
+  struct {
+    /** Smoothed response time, in ms */
+    uint16_t srtt;
+    /** Smoothed mean deviation of the response time, in ms */
+    uint16_t rttvar;
+    /** Timeout set through setTimeout, or 0 */
+    uint16_t fixed;
+    /** Number of responses seen, up to MIN_TIMEOUT_SAMPLES */
+    uint8_t samples;
+  } timeouts[GS_TIMEOUT_CLASS_COUNT] = {};
+
+  /** The currently active batch of commands, if any */
+  struct {
+    /** Where to store the responses, may be NULL */
+    GSResponse *results;
+    /** The maximum number of commands in the batch */
+    uint8_t size;
+    /** The number of commands sent */
+    uint8_t sent;
+    /** The number of replies read */
+    uint8_t read;
+    /** The timeout class of each unanswered command */
+    TimeoutClass classes[MAX_BATCH_PENDING];
+    /** Called when each unanswered command succeeds, may be NULL */
+    void (*on_ok[MAX_BATCH_PENDING])(GSCore &gs);
+    /** Is a batch active? */
+    bool active : 1;
+    /** Did any of the commands fail? */
+    bool failed : 1;
+  } batch;
+
+  /** The pending asynchronous command, if any */
+  AsyncCommand *async_command = NULL;
+
+  /** Buffer for data lines in the reply of an asynchronous command */
+  uint8_t async_response_buf[MAX_DATA_LINE_SIZE];
+
   /**
    * Ringbuffer for connection data, received while processing a command
    * (e.g., when we can't return this connection data to the
    * application).
    */
   uint8_t rx_data[RX_DATA_BUF_SIZE];
-  typedef uint16_t rx_data_index_t;
 
   /** Current state for the data stream read from the module */
   RXState rx_state;
@@ -820,6 +2069,12 @@ protected:
 
   ConnectionInfo connections[MAX_CID + 1];
 
+  /**
+   * Cids whose connection went down and were not connected again since
+   * (one bit per cid)
+   */
+  uint16_t disconnected_cids;
+
   /**
    * The cid of the automatic connection created by the network
    * connection manager, if known.
@@ -829,6 +2084,74 @@ protected:
   /** Are we associated? */
   uint8_t associated;
 
+  /**
+   * Data frames sent for which no <ESC>O or <ESC>F reply was received
+   * yet, oldest first. Each entry contains the cid of the frame,
+   * possibly combined with TX_PENDING_DEFERRED.
+   */
+  uint8_t tx_pending[MAX_TX_PENDING];
+  /** The ConnectionInfo::tx_offset of each frame in tx_pending */
+  uint32_t tx_pending_offset[MAX_TX_PENDING];
+  /** The offset into tx_pending of the oldest frame */
+  uint8_t tx_pending_head;
+  /** The number of entries in tx_pending */
+  uint8_t tx_unacked;
+
+  /** Set in tx_pending for pipelined frames */
+  static const uint8_t TX_PENDING_DEFERRED = 0x80;
+  /**
+   * Set in tx_pending for frames whose payload was sent without waiting
+   * for the reply. When such a frame is rejected, the module passes its
+   * payload to the command interpreter instead.
+   */
+  static const uint8_t TX_PENDING_EARLY = 0x40;
+
+  /**
+   * Set when a frame with TX_PENDING_EARLY was rejected, so the module
+   * must be resynced (see resyncTx) before sending the next command or
+   * pipelined frame.
+   */
+  bool tx_resync;
+
+  /**
+   * When not 0, the reply to a command timed out but might still
+   * arrive, so syncTx drops replies until the module was quiet for this
+   * many milliseconds.
+   */
+  uint16_t lost_reply_timeout;
+
+  /**
+   * The number of pipelined frames that can be pending, or 0 when
+   * pipelining is disabled.
+   */
+  uint8_t tx_pipeline_depth = 0;
+
+  /**
+   * Replies to data frames that were received, but not handled yet. The
+   * oldest reply is in bit 0, a 1 bit means <ESC>O, a 0 bit means
+   * <ESC>F.
+   */
+  uint8_t tx_replies;
+  /** The number of valid bits in tx_replies */
+  uint8_t tx_replies_len;
+
+  /**
+   * Ringbuffer for data queued by writeDataAsync. Every frame is stored
+   * as a cid byte, a two-byte length (little endian) and the data.
+   */
+  uint8_t tx_queue[TX_QUEUE_SIZE];
+  /** The offset into tx_queue where the next frame should be written to */
+  uint16_t tx_queue_head;
+  /** The offset into tx_queue of the oldest frame */
+  uint16_t tx_queue_tail;
+  /** The number of bytes used in tx_queue */
+  uint16_t tx_queue_len;
+  /**
+   * The number of bytes (header and data) of the oldest queued frame
+   * that were written already.
+   */
+  uint16_t tx_queue_sent;
+
   /** This byte is sent when there is no real data */
   static const uint8_t SPI_SPECIAL_IDLE = 0xf5;
   /** Indicates the buffer is full and no further data should be sent */
@@ -846,16 +2169,40 @@ protected:
   /** Escaped bytes are xored with this value */
   static const uint8_t SPI_ESC_XOR = 0x20;
 
-  enum {
-    EVENT_NONE = 0,
-    EVENT_NCM_CONNECTED = 1,
-    EVENT_NCM_DISCONNECTED = 2,
-    EVENT_ASSOCIATED = 4,
-    EVENT_DISASSOCIATED = 8,
-  };
+  /** Events that have been triggered but have not been dispatched yet. */
+  Event event_queue[EVENT_QUEUE_SIZE];
+  /** The cid_generation of each event in event_queue */
+  uint8_t event_generation[EVENT_QUEUE_SIZE];
+  /** Index of the oldest event in event_queue */
+  uint8_t event_queue_head;
+  /** Number of events in event_queue */
+  uint8_t event_queue_len;
+  /** Number of events lost because event_queue was full */
+  uint16_t events_lost;
+  /** Cids with a GS_EVENT_DATA event in event_queue (one bit per cid) */
+  uint16_t data_events;
+
+  /** Handlers set through setCidHandler */
+  struct {
+    cid_handler_t handler;
+    void *data;
+    /** The cid_generation this handler belongs to */
+    uint8_t generation;
+  } cid_handlers[MAX_CID + 1] = {};
+
+  /**
+   * Incremented for every new connection on a cid, to tell apart
+   * events and handlers for an old and new connection on the same cid
+   */
+  uint8_t cid_generation[MAX_CID + 1] = {};
+
+  /** See setStateRefreshInterval() */
+  uint16_t state_refresh_interval = DEFAULT_STATE_REFRESH_INTERVAL;
+  /** The time of the last refresh by refreshState() */
+  unsigned long last_state_refresh = 0;
 
-  /** Events that have been triggered but have not been handled yet. */
-  uint8_t events;
+  /** Handlers registered through addLoopHandler */
+  LoopHandler *loop_handlers = NULL;
 
   /** Where to send error output. Can be NULL to disable output. */
   Print *error;
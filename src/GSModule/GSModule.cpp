@@ -26,26 +26,37 @@
 
 #include "GSModule.h"
 #include "util.h"
+#include "static_assert.h"
 
 GSCore::cid_t GSModule::connectTcp(const IPAddress& ip, uint16_t port)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-  writeCommand("AT+NCTCP=%s,%d", buf, port);
-  cid_t cid = INVALID_CID;
-  if (readResponse(&cid) != GS_SUCCESS || cid > MAX_CID)
-    return INVALID_CID;
+  AsyncCommand cmd;
+  connectTcpAsync(&cmd, ip, port);
+  waitAsyncCommand();
+  return cmd.cid;
+}
 
-  processConnect(cid, ip, port, 0, false);
+void GSModule::connectTcpAsync(AsyncCommand *cmd, const IPAddress& ip, uint16_t port)
+{
+  cmd->cid = INVALID_CID;
+  cmd->ip = ip;
+  cmd->port = port;
+  prepareAsyncCommand(cmd, finishConnectTcp);
+  command(F("AT+NCTCP="), GS_TIMEOUT_REMOTE).ip(ip).chr(',').num(port).sendAsync(cmd);
+}
 
-  return cid;
+bool GSModule::finishConnectTcp(GSCore &gs, AsyncCommand *cmd)
+{
+  if (cmd->response != GS_SUCCESS || cmd->cid > MAX_CID)
+    cmd->cid = INVALID_CID;
+  else
+    ((GSModule&)gs).processConnect(cmd->cid, cmd->ip, cmd->port, 0, false);
+  return true;
 }
 
 GSCore::cid_t GSModule::connectUdp(const IPAddress& ip, uint16_t port, uint16_t local_port)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-  writeCommand("AT+NCUDP=%s,%d", buf, port);
+  command(F("AT+NCUDP="), GS_TIMEOUT_NETWORK).ip(ip).chr(',').num(port).send();
   cid_t cid = INVALID_CID;
   if (readResponse(&cid) != GS_SUCCESS || cid > MAX_CID)
     return INVALID_CID;
@@ -57,7 +68,7 @@ GSCore::cid_t GSModule::connectUdp(const IPAddress& ip, uint16_t port, uint16_t
 
 GSCore::cid_t GSModule::listenUdp(uint16_t port)
 {
-  writeCommand("AT+NSUDP=%u",port);
+  command(F("AT+NSUDP="), GS_TIMEOUT_NETWORK).num(port).send();
   cid_t cid = INVALID_CID;
   if (readResponse(&cid) != GS_SUCCESS || cid > MAX_CID)
     return INVALID_CID;
@@ -69,78 +80,508 @@ GSCore::cid_t GSModule::listenUdp(uint16_t port)
 
 bool GSModule::associate(const char *ssid, const char *bssid, uint8_t channel, bool best_rssi)
 {
-  bool ok = writeCommandCheckOk("AT+WA=\"%s\",%s,%d,%d", ssid, bssid ?: "", channel, best_rssi);
-  if (ok)
-    processAssociation();
-  return ok;
+  AsyncCommand cmd;
+  associateAsync(&cmd, ssid, bssid, channel, best_rssi);
+  waitAsyncCommand();
+  return cmd.response == GS_SUCCESS;
+}
+
+void GSModule::associateAsync(AsyncCommand *cmd, const char *ssid, const char *bssid, uint8_t channel, bool best_rssi)
+{
+  prepareAsyncCommand(cmd, finishAssociate);
+  command(F("AT+WA="), GS_TIMEOUT_ASSOCIATE).quoted(ssid).chr(',').str(bssid ?: "")
+       .chr(',').num(channel).chr(',').num(best_rssi).sendAsync(cmd);
+}
+
+bool GSModule::finishAssociate(GSCore &gs, AsyncCommand *cmd)
+{
+  if (cmd->response == GS_SUCCESS)
+    ((GSModule&)gs).processAssociation();
+  return true;
 }
 
 bool GSModule::disassociate()
 {
-  bool ok = writeCommandCheckOk("AT+WD");
-  if (ok)
-    processDisassociation();
+  return command(F("AT+WD"), GS_TIMEOUT_NETWORK).checkOk(disassociated);
+}
+
+/**
+ * Returns true when a string setting matches the copy remembered in
+ * buf. NULL never matches.
+ */
+static bool shadow_str_matches(const char *buf, const char *s)
+{
+  return s && strcmp(buf, s) == 0;
+}
+
+/**
+ * Remember a string setting in buf.
+ *
+ * @returns false when s is NULL or does not fit, in which case it
+ *          should not be remembered.
+ */
+static bool shadow_str_store(char *buf, size_t size, const char *s)
+{
+  if (!s || strlen(s) >= size)
+    return false;
+  strcpy(buf, s);
+  return true;
+}
+
+bool GSModule::shadowMatches(uint8_t setting, uint32_t value)
+{
+  // After a reboot, the module uses its default settings
+  if (this->shadow_boot_count != this->boot_count) {
+    this->shadow_valid = 0;
+    this->shadow_boot_count = this->boot_count;
+  }
+
+  if (setting >= SHADOW_COUNT)
+    return false;
+
+  return (this->shadow_valid & (1UL << setting)) && this->shadow[setting] == value;
+}
+
+bool GSModule::shadowUpdate(uint8_t setting, uint32_t value, bool ok)
+{
+  if (setting >= SHADOW_COUNT)
+    return ok;
+
+  // In a batch, ok does not mean anything yet, so don't remember
+  // anything. Also, when a command fails the setting might still have
+  // changed.
+  if (ok && !batchActive()) {
+    this->shadow[setting] = value;
+    this->shadow_valid |= (1UL << setting);
+  } else {
+    this->shadow_valid &= ~(1UL << setting);
+  }
+  return ok;
+}
+
+bool GSModule::setAuth(GSAuth auth)
+{
+  if (shadowMatches(SHADOW_AUTH, auth))
+    return true;
+
+  return shadowUpdate(SHADOW_AUTH, auth, command(F("AT+WAUTH=")).num(auth).checkOk());
+}
+
+bool GSModule::setSecurity(GSSecurity sec)
+{
+  if (shadowMatches(SHADOW_SECURITY, sec))
+    return true;
+
+  return shadowUpdate(SHADOW_SECURITY, sec, command(F("AT+WSEC=")).num(sec).checkOk());
+}
+
+bool GSModule::setWpaPassphrase(const char *passphrase)
+{
+  // Both this and setPskPassphrase set the passphrase, so they share
+  // the same setting
+  if (shadowMatches(SHADOW_PSK, SHADOW_PSK_PASSPHRASE)
+      && shadow_str_matches(this->shadow_passphrase, passphrase))
+    return true;
+
+  bool ok = command(F("AT+WWPA=")).quoted(passphrase).checkOk();
+  bool fits = shadow_str_store(this->shadow_passphrase, sizeof(this->shadow_passphrase), passphrase);
+  shadowUpdate(SHADOW_PSK, SHADOW_PSK_PASSPHRASE, ok && fits);
+  return ok;
+}
+
+bool GSModule::setWepPassphrase(const char *passphrase)
+{
+  if (shadowMatches(SHADOW_WEP, 0) && shadow_str_matches(this->shadow_wep, passphrase))
+    return true;
+
+  bool ok = command(F("AT+WWEP1=")).str(passphrase).checkOk();
+  bool fits = shadow_str_store(this->shadow_wep, sizeof(this->shadow_wep), passphrase);
+  shadowUpdate(SHADOW_WEP, 0, ok && fits);
+  return ok;
+}
+
+bool GSModule::setPskPassphrase(const char *passphrase, const char *ssid)
+{
+  if (shadowMatches(SHADOW_PSK, SHADOW_PSK_SSID)
+      && shadow_str_matches(this->shadow_passphrase, passphrase)
+      && shadow_str_matches(this->shadow_ssid, ssid))
+    return true;
+
+  bool ok = command(F("AT+WPAPSK="), GS_TIMEOUT_OTHER).quoted(ssid).chr(',').quoted(passphrase).checkOk();
+  bool fits = shadow_str_store(this->shadow_passphrase, sizeof(this->shadow_passphrase), passphrase)
+              && shadow_str_store(this->shadow_ssid, sizeof(this->shadow_ssid), ssid);
+  shadowUpdate(SHADOW_PSK, SHADOW_PSK_SSID, ok && fits);
   return ok;
 }
 
 bool GSModule::setDhcp(bool enable, const char *hostname)
 {
+  // When associated, this command also starts a DHCP request or
+  // applies the static configuration, so always send it then
+  uint32_t value = enable | (hostname ? 2 : 0);
+  if (!this->associated && shadowMatches(SHADOW_DHCP, value)
+      && (!hostname || shadow_str_matches(this->shadow_hostname, hostname)))
+    return true;
+
+  bool ok;
   if (hostname)
-    return writeCommandCheckOk("AT+NDHCP=%d,\"%s\"", enable, hostname);
+    ok = command(F("AT+NDHCP="), GS_TIMEOUT_NETWORK).num(enable).chr(',').quoted(hostname).checkOk();
   else
-    return writeCommandCheckOk("AT+NDHCP=%d", enable);
+    ok = command(F("AT+NDHCP="), GS_TIMEOUT_NETWORK).num(enable).checkOk();
+  bool fits = !hostname || shadow_str_store(this->shadow_hostname, sizeof(this->shadow_hostname), hostname);
+  shadowUpdate(SHADOW_DHCP, value, ok && fits);
+  return ok;
 }
 
 bool GSModule::setStaticIp(const IPAddress& ip, const IPAddress& netmask, const IPAddress& gateway)
 {
-  uint8_t ip_buf[16], nm_buf[16], gw_buf[16];
-  snprintf((char*)ip_buf, sizeof(ip_buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-  snprintf((char*)nm_buf, sizeof(nm_buf), "%d.%d.%d.%d", netmask[0], netmask[1], netmask[2], netmask[3]);
-  snprintf((char*)gw_buf, sizeof(gw_buf), "%d.%d.%d.%d", gateway[0], gateway[1], gateway[2], gateway[3]);
-  return writeCommandCheckOk("AT+NSET=%s,%s,%s", ip_buf, nm_buf, gw_buf);
+  if (shadowMatches(SHADOW_STATIC_IP, ip)
+      && shadowMatches(SHADOW_STATIC_IP + 1, netmask)
+      && shadowMatches(SHADOW_STATIC_IP + 2, gateway))
+    return true;
+
+  bool ok = command(F("AT+NSET="), GS_TIMEOUT_NETWORK).ip(ip).chr(',').ip(netmask).chr(',').ip(gateway).checkOk();
+  shadowUpdate(SHADOW_STATIC_IP, ip, ok);
+  shadowUpdate(SHADOW_STATIC_IP + 1, netmask, ok);
+  return shadowUpdate(SHADOW_STATIC_IP + 2, gateway, ok);
 }
 
 bool GSModule::setDns(const IPAddress& dns1, const IPAddress& dns2)
 {
-  uint8_t buf1[16], buf2[16];
-  snprintf((char*)buf1, sizeof(buf1), "%d.%d.%d.%d", dns1[0], dns1[1], dns1[2], dns1[3]);
-  snprintf((char*)buf2, sizeof(buf2), "%d.%d.%d.%d", dns2[0], dns2[1], dns2[2], dns2[3]);
+  if (shadowMatches(SHADOW_DNS, 2)
+      && shadowMatches(SHADOW_DNS + 1, dns1)
+      && shadowMatches(SHADOW_DNS + 2, dns2))
+    return true;
 
-  return writeCommandCheckOk("AT+DNSSET=%s,%s", buf1, buf2);
+  bool ok = command(F("AT+DNSSET=")).ip(dns1).chr(',').ip(dns2).checkOk();
+  shadowUpdate(SHADOW_DNS, 2, ok);
+  shadowUpdate(SHADOW_DNS + 1, dns1, ok);
+  return shadowUpdate(SHADOW_DNS + 2, dns2, ok);
 }
 
 bool GSModule::setDns(const IPAddress& dns)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", dns[0], dns[1], dns[2], dns[3]);
+  // Remember the number of servers, since setDns(dns, 0.0.0.0) might
+  // not have the same effect
+  if (shadowMatches(SHADOW_DNS, 1) && shadowMatches(SHADOW_DNS + 1, dns))
+    return true;
+
+  bool ok = command(F("AT+DNSSET=")).ip(dns).checkOk();
+  shadowUpdate(SHADOW_DNS, 1, ok);
+  return shadowUpdate(SHADOW_DNS + 1, dns, ok);
+}
+
+bool GSModule::setParam(GSParam param, uint16_t value)
+{
+  uint8_t setting = SHADOW_COUNT;
+  if ((uint8_t)param < SHADOW_PARAM_COUNT)
+    setting = SHADOW_PARAM + param;
+
+  if (shadowMatches(setting, value))
+    return true;
+
+  return shadowUpdate(setting, value, command(F("ATS")).num(param).chr('=').num(value).checkOk());
+}
+
+bool GSModule::setNcmParam(GSNcmParam param, uint16_t value)
+{
+  uint8_t setting = SHADOW_COUNT;
+  if ((uint8_t)param < SHADOW_NCM_PARAM_COUNT)
+    setting = SHADOW_NCM_PARAM + param;
+
+  if (shadowMatches(setting, value))
+    return true;
 
-  return writeCommandCheckOk("AT+DNSSET=%s", buf);
+  return shadowUpdate(setting, value, command(F("AT+NCMAUTOCONF=")).num(param).chr(',').num(value).checkOk());
 }
 
 bool GSModule::disconnect(cid_t cid)
 {
   if (cid > MAX_CID)
     return false;
-  return writeCommandCheckOk("AT+NCLOSE=%x", cid);
+  return command(F("AT+NCLOSE="), GS_TIMEOUT_NETWORK).hex(cid).checkOk();
 }
 
 bool GSModule::timeSync(const IPAddress& server, uint32_t interval, uint8_t timeout)
 {
-  uint8_t buf[16];
-  snprintf((char*)buf, sizeof(buf), "%d.%d.%d.%d", server[0], server[1], server[2], server[3]);
+  AsyncCommand cmd;
+  timeSyncAsync(&cmd, server, interval, timeout);
+  waitAsyncCommand();
+  return cmd.response == GS_SUCCESS;
+}
 
+void GSModule::timeSyncAsync(AsyncCommand *cmd, const IPAddress& server, uint32_t interval, uint8_t timeout)
+{
+  cmd->ip = server;
+  cmd->port = timeout;
+  cmd->arg = interval;
+  prepareAsyncCommand(cmd, finishTimeSync);
   // First, send the command without an interval, to force a sync now
-  if (!writeCommandCheckOk("AT+NTIMESYNC=1,%s,%d,0", buf, timeout))
+  command(F("AT+NTIMESYNC=1,"), GS_TIMEOUT_REMOTE).ip(server).chr(',').num(timeout).str(F(",0")).sendAsync(cmd);
+}
+
+bool GSModule::finishTimeSync(GSCore &gs, AsyncCommand *cmd)
+{
+  if (cmd->response != GS_SUCCESS || !cmd->arg)
+    return true;
+
+  // Then, schedule periodic syncs if requested
+  uint32_t interval = cmd->arg;
+  cmd->arg = 0;
+  gs.command(F("AT+NTIMESYNC=1,"), GS_TIMEOUT_REMOTE).ip(cmd->ip).chr(',').num(cmd->port).str(F(",1,")).num(interval).sendAsync(cmd);
+  return false;
+}
+
+int GSModule::scan(scan_callback_t callback, void *data, const char *ssid, uint16_t channels, uint16_t scan_time)
+{
+  ScanState state = {callback, data, 0};
+  uint8_t channel = 0;
+
+  do {
+    // Find the next channel to scan, if any
+    if (channels) {
+      while (++channel < 16 && !(channels & (1 << channel))) /* nothing */;
+      if (channel == 16)
+        break;
+    }
+
+    // AT+WS[=<SSID>[,<BSSID>][,<Channel>][,<ScanTime>]]
+    Command cmd = command(F("AT+WS"), GS_TIMEOUT_SCAN);
+    if (ssid || channel || scan_time) {
+      cmd.chr('=');
+      if (ssid)
+        cmd.quoted(ssid);
+      if (channel || scan_time)
+        cmd.str(F(",,"));
+      if (channel)
+        cmd.num(channel);
+      if (scan_time)
+        cmd.chr(',').num(scan_time);
+    }
+    cmd.send();
+
+    if (readResponse(processScanLine, &state) != GS_SUCCESS)
+      return -1;
+  } while (channels);
+
+  return state.count;
+}
+
+/**
+ * Remove leading and trailing spaces from the given string.
+ */
+static void trim(const uint8_t **buf, uint16_t *len)
+{
+  while (*len && (*buf)[0] == ' ') {
+    ++*buf;
+    --*len;
+  }
+  while (*len && (*buf)[*len - 1] == ' ')
+    --*len;
+}
+
+/**
+ * Compare a (not 0-terminated) buffer with a string.
+ */
+static bool field_equals(const uint8_t *buf, uint16_t len, const char *str)
+{
+  return len == strlen(str) && !memcmp(buf, str, len);
+}
+
+void GSModule::processScanLine(const uint8_t *buf, uint16_t len, void *data)
+{
+  ScanState *state = (ScanState*)data;
+  ScanResult res;
+
+  // Lines look like this, with the SSID padded with spaces:
+  //  00:1d:7e:2b:13:10, linksys              , 06, INFRA , -39 , WPA2-PERSONAL
+  // Since the SSID might contain commas as well, split off the BSSID
+  // from the start and the other fields from the end. The header and
+  // "No.Of AP Found" lines do not have enough fields.
+  const uint8_t NUM_FIELDS = 6;
+  const uint8_t *fields[NUM_FIELDS];
+  uint16_t lens[NUM_FIELDS];
+
+  const uint8_t *comma = (const uint8_t*)memchr(buf, ',', len);
+  if (!comma)
+    return;
+  fields[0] = buf;
+  lens[0] = comma - buf;
+
+  const uint8_t *end = buf + len;
+  for (uint8_t i = NUM_FIELDS - 1; i > 1; --i) {
+    const uint8_t *p = end;
+    while (p > comma + 1 && p[-1] != ',')
+      --p;
+    if (p <= comma + 1)
+      return;
+    fields[i] = p;
+    lens[i] = end - p;
+    end = p - 1;
+  }
+  fields[1] = comma + 1;
+  lens[1] = end - fields[1];
+
+  // The SSID might start with spaces, so only drop the one separating
+  // it from the comma. Trailing spaces cannot be told from padding.
+  if (lens[1] && fields[1][0] == ' ') {
+    fields[1]++;
+    lens[1]--;
+  }
+  while (lens[1] && fields[1][lens[1] - 1] == ' ')
+    lens[1]--;
+
+  for (uint8_t i = 0; i < NUM_FIELDS; ++i) {
+    if (i != 1)
+      trim(&fields[i], &lens[i]);
+  }
+
+  if (!parseMacAddress(res.bssid, fields[0], lens[0]))
+    return;
+
+  // SSID
+  if (lens[1] >= sizeof(res.ssid))
+    return;
+  memcpy(res.ssid, fields[1], lens[1]);
+  res.ssid[lens[1]] = '\0';
+
+  if (!parseNumber(&res.channel, fields[2], lens[2], 10))
+    return;
+
+  if (field_equals(fields[3], lens[3], "INFRA"))
+    res.mode = GS_INFRASTRUCTURE;
+  else if (field_equals(fields[3], lens[3], "ADHOC"))
+    res.mode = GS_ADHOC;
+  else
+    return;
+
+  if (!parseRssi(&res.rssi, fields[4], lens[4]))
+    return;
+
+  res.security = parseSecurity(fields[5], lens[5]);
+
+  state->count++;
+  if (state->callback)
+    state->callback(&res, state->data);
+}
+
+bool GSModule::parseMacAddress(uint8_t *mac, const uint8_t *buf, uint16_t len)
+{
+  if (len != 17)
     return false;
+  for (uint8_t i = 0; i < 6; ++i) {
+    if (i > 0 && buf[i * 3 - 1] != ':')
+      return false;
+    if (!parseNumber(&mac[i], buf + i * 3, 2, 16))
+      return false;
+  }
+  return true;
+}
 
-  if (interval) {
-    // Then, schedule periodic syncs if requested
-    if (!writeCommandCheckOk("AT+NTIMESYNC=1,%s,%d,1,%d", buf, timeout, interval))
+bool GSModule::parseRssi(int8_t *rssi, const uint8_t *buf, uint16_t len)
+{
+  // Normally negative, but accept positive values as well
+  uint8_t n;
+  if (len > 1 && buf[0] == '-') {
+    if (!parseNumber(&n, buf + 1, len - 1, 10) || n > 128)
+      return false;
+    *rssi = -(int16_t)n;
+  } else {
+    if (!parseNumber(&n, buf, len, 10) || n > 127)
       return false;
+    *rssi = n;
   }
   return true;
 }
 
+GSModule::GSSecurity GSModule::parseSecurity(const uint8_t *buf, uint16_t len)
+{
+  if (field_equals(buf, len, "NONE"))
+    return GS_SECURITY_OPEN;
+  if (field_equals(buf, len, "WEP"))
+    return GS_SECURITY_WEP;
+  if (field_equals(buf, len, "WPA-PERSONAL"))
+    return GS_SECURITY_WPA1_PSK;
+  if (field_equals(buf, len, "WPA2-PERSONAL"))
+    return GS_SECURITY_WPA2_PSK;
+  if (field_equals(buf, len, "WPA-ENTERPRISE"))
+    return GS_SECURITY_WPA1_ENTERPRISE;
+  if (field_equals(buf, len, "WPA2-ENTERPRISE"))
+    return GS_SECURITY_WPA2_ENTERPRISE;
+  return GS_SECURITY_AUTO;
+}
+
+const GSModule::Status *GSModule::getStatus(bool refresh)
+{
+  readAndProcessAsync();
+
+  // Use the cached status, unless it is too old or the association
+  // state changed since
+  if (!refresh && this->status_valid &&
+      this->status_boot_count == this->boot_count &&
+      (bool)this->associated == this->status.associated &&
+      (unsigned long)(millis() - this->status_time) < this->status_max_age)
+    return &this->status;
+
+  this->status = Status();
+  this->status_valid = false;
+
+  command(F("AT+NSTAT=?")).send();
+  if (readResponse(processNstatLine, &this->status) != GS_SUCCESS)
+    return NULL;
+
+  this->status_valid = true;
+  this->status_time = millis();
+  this->status_boot_count = this->boot_count;
+  return &this->status;
+}
+
+void GSModule::processNstatLine(const uint8_t *buf, uint16_t len, void *data)
+{
+  parseStatusLine(buf, len, processNstatField, data);
+}
+
+void GSModule::processNstatField(const uint8_t *key, uint16_t key_len, const uint8_t *value, uint16_t value_len, void *data)
+{
+  Status *status = (Status*)data;
+
+  if (statusKeyMatches(key, key_len, "MAC")) {
+    parseMacAddress(status->mac, value, value_len);
+  } else if (statusKeyMatches(key, key_len, "WSTATE")) {
+    status->associated = field_equals(value, value_len, "CONNECTED");
+  } else if (statusKeyMatches(key, key_len, "MODE")) {
+    if (field_equals(value, value_len, "ADHOC"))
+      status->mode = GS_ADHOC;
+    else if (field_equals(value, value_len, "LIMITED AP") || field_equals(value, value_len, "LIMITED"))
+      status->mode = GS_LIMITED_AP;
+    else
+      status->mode = GS_INFRASTRUCTURE;
+  } else if (statusKeyMatches(key, key_len, "BSSID")) {
+    parseMacAddress(status->bssid, value, value_len);
+  } else if (statusKeyMatches(key, key_len, "SSID")) {
+    if (value_len < sizeof(status->ssid)) {
+      memcpy(status->ssid, value, value_len);
+      status->ssid[value_len] = '\0';
+    }
+  } else if (statusKeyMatches(key, key_len, "CHANNEL")) {
+    parseNumber(&status->channel, value, value_len, 10);
+  } else if (statusKeyMatches(key, key_len, "SECURITY")) {
+    status->security = parseSecurity(value, value_len);
+  } else if (statusKeyMatches(key, key_len, "RSSI")) {
+    parseRssi(&status->rssi, value, value_len);
+  } else if (statusKeyMatches(key, key_len, "IP addr")) {
+    parseIpAddress(&status->ip, (const char*)value, value_len);
+  } else if (statusKeyMatches(key, key_len, "SubNet")) {
+    parseIpAddress(&status->netmask, (const char*)value, value_len);
+  } else if (statusKeyMatches(key, key_len, "Gateway")) {
+    parseIpAddress(&status->gateway, (const char*)value, value_len);
+  } else if (statusKeyMatches(key, key_len, "DNS1")) {
+    parseIpAddress(&status->dns1, (const char*)value, value_len);
+  } else if (statusKeyMatches(key, key_len, "DNS2")) {
+    parseIpAddress(&status->dns2, (const char*)value, value_len);
+  }
+}
+
 static void parse_ip_response(const uint8_t *buf, uint16_t len, void *data)
 {
   if (len < 3 || strncmp((const char*)buf, "IP:", 3) != 0)
@@ -152,62 +593,253 @@ static void parse_ip_response(const uint8_t *buf, uint16_t len, void *data)
 
 IPAddress GSModule::dnsLookup(const char *name)
 {
-  IPAddress result = INADDR_NONE;
-  writeCommand("AT+DNSLOOKUP=%s", name);
-  if (readResponse(parse_ip_response, &result) != GS_SUCCESS)
-    result = INADDR_NONE;
-  return result;
+  AsyncCommand cmd;
+  dnsLookupAsync(&cmd, name);
+  waitAsyncCommand();
+  return cmd.ip;
 }
 
-bool GSModule::enableTls(cid_t cid, const char *certname)
+void GSModule::dnsLookupAsync(AsyncCommand *cmd, const char *name)
 {
-  if (cid > MAX_CID)
-    return false;
+  cmd->ip = INADDR_NONE;
+  prepareAsyncCommand(cmd, finishDnsLookup, parse_ip_response, &cmd->ip);
+  command(F("AT+DNSLOOKUP="), GS_TIMEOUT_REMOTE).str(name).sendAsync(cmd);
+}
 
-  if (writeCommandCheckOk("AT+SSLOPEN=%x,%s", cid, certname)) {
-    this->connections[cid].ssl = true;
+bool GSModule::finishDnsLookup(GSCore & /* gs */, AsyncCommand *cmd)
+{
+  if (cmd->response != GS_SUCCESS)
+    cmd->ip = INADDR_NONE;
+  return true;
+}
+
+IPAddress GSModule::resolve(const char *name)
+{
+  IPAddress ip;
+  if (parseIpAddress(&ip, name))
+    return ip;
+
+  // Let a running prefetch (possibly for this name) finish first
+  if (this->dns_prefetch_cmd.pending)
+    waitAsyncCommand();
+
+  DnsCacheEntry *entry = dnsCacheFind(name);
+  if (entry) {
+    entry->used = millis();
+    return entry->ip;
+  }
+
+  ip = dnsLookup(name);
+  if ((uint32_t)ip)
+    dnsCacheStore(name, ip);
+  return ip;
+}
+
+bool GSModule::prefetchHost(const char *name)
+{
+  IPAddress ip;
+  if (!this->dns_ttl || parseIpAddress(&ip, name) || dnsCacheFind(name))
     return true;
-  } else {
-    this->connections[cid].error = true;
-    processDisconnect(cid);
+
+  if (this->dns_prefetch_len == DNS_PREFETCH_SIZE)
     return false;
+
+  this->dns_prefetch[this->dns_prefetch_len++] = name;
+  addLoopHandler(&this->dns_prefetcher);
+  return true;
+}
+
+void GSModule::forgetHost(const char *name)
+{
+  DnsCacheEntry *entry = dnsCacheFind(name);
+  if (entry)
+    entry->ip = 0;
+}
+
+void GSModule::flushDnsCache()
+{
+  for (uint8_t i = 0; i < DNS_CACHE_SIZE; ++i)
+    this->dns_cache[i].ip = 0;
+}
+
+GSModule::DnsCacheEntry *GSModule::dnsCacheFind(const char *name)
+{
+  for (uint8_t i = 0; i < DNS_CACHE_SIZE; ++i) {
+    DnsCacheEntry *entry = &this->dns_cache[i];
+    if (!entry->ip || strcmp(entry->name, name))
+      continue;
+
+    if ((unsigned long)(millis() - entry->resolved) >= this->dns_ttl * 1000UL) {
+      entry->ip = 0;
+      return NULL;
+    }
+    return entry;
+  }
+  return NULL;
+}
+
+void GSModule::dnsCacheStore(const char *name, const IPAddress& ip)
+{
+  static_assert( DNS_CACHE_SIZE > 0, "DNS_CACHE_SIZE must be at least 1, use setDnsTtl(0) to disable the cache" );
+
+  if (!this->dns_ttl || strlen(name) > MAX_DNS_CACHE_NAME_LEN)
+    return;
+
+  // Replace an existing entry for the same name, or else an unused
+  // entry, or else the least recently used entry.
+  DnsCacheEntry *entry = dnsCacheFind(name);
+  for (uint8_t i = 0; !entry && i < DNS_CACHE_SIZE; ++i) {
+    if (!this->dns_cache[i].ip)
+      entry = &this->dns_cache[i];
+  }
+  if (!entry) {
+    entry = &this->dns_cache[0];
+    for (uint8_t i = 1; i < DNS_CACHE_SIZE; ++i) {
+      if ((long)(this->dns_cache[i].used - entry->used) < 0)
+        entry = &this->dns_cache[i];
+    }
+  }
+
+  strcpy(entry->name, name);
+  entry->ip = ip;
+  entry->resolved = entry->used = millis();
+}
+
+void GSModule::startDnsPrefetch()
+{
+  // Only use idle time, don't make other commands wait
+  if (asyncCommandPending() || batchActive())
+    return;
+
+  if (!this->dns_prefetch_len) {
+    removeLoopHandler(&this->dns_prefetcher);
+    return;
+  }
+
+  const char *name = this->dns_prefetch[0];
+  this->dns_prefetch_len--;
+  memmove(this->dns_prefetch, this->dns_prefetch + 1, this->dns_prefetch_len * sizeof(*this->dns_prefetch));
+
+  // Might have been resolved since it was queued
+  if (dnsCacheFind(name))
+    return;
+
+  this->dns_prefetch_name = name;
+  this->dns_prefetch_cmd.onComplete = finishDnsPrefetch;
+  this->dns_prefetch_cmd.data = this;
+  dnsLookupAsync(&this->dns_prefetch_cmd, name);
+}
+
+void GSModule::finishDnsPrefetch(void *data, AsyncCommand *cmd)
+{
+  GSModule *gs = (GSModule*)data;
+  if ((uint32_t)cmd->ip)
+    gs->dnsCacheStore(gs->dns_prefetch_name, cmd->ip);
+}
+
+bool GSModule::enableTls(cid_t cid, const char *certname)
+{
+  AsyncCommand cmd;
+  enableTlsAsync(&cmd, cid, certname);
+  waitAsyncCommand();
+  return cmd.response == GS_SUCCESS;
+}
+
+void GSModule::enableTlsAsync(AsyncCommand *cmd, cid_t cid, const char *certname)
+{
+  if (cid > MAX_CID) {
+    // Complete right away
+    cmd->pending = false;
+    cmd->response = GS_EBADCID;
+    if (cmd->onComplete)
+      cmd->onComplete(cmd->data, cmd);
+    return;
   }
+
+  cmd->cid = cid;
+  prepareAsyncCommand(cmd, finishEnableTls);
+  command(F("AT+SSLOPEN="), GS_TIMEOUT_REMOTE).hex(cid).chr(',').str(certname).sendAsync(cmd);
+}
+
+bool GSModule::finishEnableTls(GSCore &gs, AsyncCommand *cmd)
+{
+  GSModule &module = (GSModule&)gs;
+  if (cmd->response == GS_SUCCESS) {
+    module.connections[cmd->cid].ssl = true;
+  } else {
+    module.connections[cmd->cid].error = true;
+    module.processDisconnect(cmd->cid);
+  }
+  return true;
 }
 
 bool GSModule::addCert(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len) {
-  if (!writeCommandCheckOk("AT+TCERTADD=%s,0,%d,%d", certname, len, !to_flash))
+  return addCertInternal(certname, to_flash, buf, len, false);
+}
+
+bool GSModule::addCert_P(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len) {
+  return addCertInternal(certname, to_flash, buf, len, true);
+}
+
+bool GSModule::addCertInternal(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len, bool progmem) {
+  if (!command(F("AT+TCERTADD="), GS_TIMEOUT_OTHER).str(certname).str(F(",0,")).num(len).chr(',').num(!to_flash).checkOk())
     return false;
 
   const uint8_t escape[] = {0x1b, 'W'};
   writeRaw(escape, sizeof(escape));
-  writeRaw(buf, len);
+  if (progmem)
+    writeRaw_P(buf, len);
+  else
+    writeRaw(buf, len);
   return readResponse() == GS_SUCCESS;
 }
 
 bool GSModule::setAutoConnectClient(const IPAddress &ip, uint16_t port, Protocol protocol)
 {
   char buf[16];
-  snprintf(buf, sizeof(buf), "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+  buf[formatIpAddress((uint8_t*)buf, ip)] = '\0';
 
   return setAutoConnectClient(buf, port, protocol);
 }
 
 bool GSModule::setAutoConnectClient(const char *host, uint16_t port, Protocol protocol)
 {
-  return writeCommandCheckOk("AT+NAUTO=0,%d,%s,%d", protocol, host, port);
+  return command(F("AT+NAUTO=0,")).num(protocol).chr(',').str(host).chr(',').num(port).checkOk();
 }
 
 bool GSModule::setAutoConnectServer(uint16_t port, Protocol protocol)
 {
-  return writeCommandCheckOk("AT+NAUTO=1,%d,,%d", protocol, port);
+  return command(F("AT+NAUTO=1,")).num(protocol).str(F(",,")).num(port).checkOk();
 }
 
 bool GSModule::setNcm(bool enabled, bool associate_only, bool remember, NCMMode mode)
 {
-  bool res = writeCommandCheckOk("AT+NCMAUTO=%d,%d,%d,%d", mode, enabled, !associate_only, !remember);
-  if (!enabled && res)
-    processDisassociation();
-  return res;
+  void (*on_ok)(GSCore &gs);
+  if (!enabled)
+    on_ok = ncmDisabled;
+  else if (associate_only)
+    on_ok = ncmAssociateEnabled;
+  else
+    on_ok = ncmConnectEnabled;
+
+  return command(F("AT+NCMAUTO="), GS_TIMEOUT_OTHER).num(mode).chr(',').num(enabled).chr(',')
+             .num(!associate_only).chr(',').num(!remember).checkOk(on_ok);
+}
+
+void GSModule::ncmConnectEnabled(GSCore &gs)
+{
+  ((GSModule&)gs).ncm_connect = true;
+}
+
+void GSModule::ncmAssociateEnabled(GSCore &gs)
+{
+  ((GSModule&)gs).ncm_connect = false;
+}
+
+void GSModule::ncmDisabled(GSCore &gs)
+{
+  ((GSModule&)gs).ncm_connect = false;
+  ((GSModule&)gs).processDisassociation();
 }
 
 // vim: set sw=2 sts=2 expandtab:
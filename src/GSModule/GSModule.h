@@ -30,6 +30,34 @@
 #include "GSCore.h"
 #include <IPAddress.h>
 
+// The sizes of the DNS cache and the remembered settings can be
+// changed at compile time to save RAM, like the buffer sizes in
+// GSCore.h. See GSModule::DNS_CACHE_SIZE and
+// GSModule::MAX_SHADOW_SSID_LEN for what they do.
+#ifndef GS_DNS_CACHE_SIZE
+#define GS_DNS_CACHE_SIZE 4
+#endif
+
+#ifndef GS_MAX_DNS_CACHE_NAME_LEN
+#define GS_MAX_DNS_CACHE_NAME_LEN 32
+#endif
+
+#ifndef GS_MAX_SHADOW_SSID_LEN
+#define GS_MAX_SHADOW_SSID_LEN 32
+#endif
+
+#ifndef GS_MAX_SHADOW_PASSPHRASE_LEN
+#define GS_MAX_SHADOW_PASSPHRASE_LEN 64
+#endif
+
+#ifndef GS_MAX_SHADOW_WEP_LEN
+#define GS_MAX_SHADOW_WEP_LEN 26
+#endif
+
+#ifndef GS_MAX_SHADOW_HOSTNAME_LEN
+#define GS_MAX_SHADOW_HOSTNAME_LEN 32
+#endif
+
 /**
  * This class allows talking to a Gainspan Serial2Wifi module. It's
  * intended for the GS1011MIPS module, but might also work with other
@@ -49,7 +77,7 @@ public:
   /**
    * Set the WEP authentication mode. Set to None for WPA.
    */
-  bool setAuth(GSAuth auth) { return writeCommandCheckOk("AT+WAUTH=%d", auth); }
+  bool setAuth(GSAuth auth);
 
   enum GSSecurity {
     GS_SECURITY_AUTO = 0,
@@ -77,26 +105,17 @@ public:
    * TODO: Double quotes and backslashes in the passphrase should be
    * backslash-escaped
    */
-  bool setSecurity(GSSecurity sec)
-  {
-    return writeCommandCheckOk("AT+WSEC=%d", sec);
-  }
+  bool setSecurity(GSSecurity sec);
 
   /**
    * Set the WPA / WPA2 PSK passhrase to use.
    */
-  bool setWpaPassphrase(const char *passphrase)
-  {
-    return writeCommandCheckOk("AT+WWPA=\"%s\"", passphrase);
-  }
+  bool setWpaPassphrase(const char *passphrase);
 
   /**
    * Set the WEP passhrase to use.
    */
-  bool setWepPassphrase(const char *passphrase)
-  {
-    return writeCommandCheckOk("AT+WWEP1=%s", passphrase);
-  }
+  bool setWepPassphrase(const char *passphrase);
 
   /**
    * Set the WPA / WPA2 PSK passhrase to use and precalculate the PSK.
@@ -109,10 +128,7 @@ public:
    * TODO: Double quotes and backslashes in the SSID and passphrase
    * should be backslash-escaped
    */
-  bool setPskPassphrase(const char *passphrase, const char *ssid)
-  {
-    return writeCommandCheckOk("AT+WPAPSK=\"%s\",\"%s\"", ssid, passphrase);
-  }
+  bool setPskPassphrase(const char *passphrase, const char *ssid);
 
   /**
    * Associate to the given SSID.
@@ -146,6 +162,9 @@ public:
    * - When associated and enable is true, a DHCP request is performed.
    * - When associated and enable is false, the static IP configuration
    *   is applied.
+   *
+   * When not associated, the command is skipped if the same settings
+   * were applied before (see forgetSettings()).
    */
   bool setDhcp(bool enable, const char *hostname = NULL);
 
@@ -176,7 +195,7 @@ public:
    */
   bool saveProfile(uint8_t profile)
   {
-    return writeCommandCheckOk("AT&W%d", profile);
+    return command(F("AT&W"), GS_TIMEOUT_OTHER).num(profile).checkOk();
   }
 
   /**
@@ -187,7 +206,9 @@ public:
    */
   bool loadProfile(uint8_t profile)
   {
-    return writeCommandCheckOk("ATZ%d", profile);
+    // All settings might change
+    forgetSettings();
+    return command(F("ATZ"), GS_TIMEOUT_OTHER).num(profile).checkOk();
   }
 
   /**
@@ -199,7 +220,7 @@ public:
    */
   bool setDefaultProfile(uint8_t profile)
   {
-    return writeCommandCheckOk("AT&Y%d", profile);
+    return command(F("AT&Y")).num(profile).checkOk();
   }
 
   enum GSParam {
@@ -271,10 +292,7 @@ public:
    * @param param    The parameter to set
    * @param value    The value to set it to
    */
-  bool setParam(GSParam param, uint16_t value)
-  {
-    return writeCommandCheckOk("ATS%d=%d", param, value);
-  }
+  bool setParam(GSParam param, uint16_t value);
 
   enum GSNcmParam {
     /**
@@ -334,9 +352,22 @@ public:
    * @param param    The parameter to set
    * @param value    The value to set it to
    */
-  bool setNcmParam(GSNcmParam param, uint16_t value)
+  bool setNcmParam(GSNcmParam param, uint16_t value);
+
+  /**
+   * The setters for the security, passphrase, IP configuration and
+   * (NCM) parameters remember the settings they applied succesfully
+   * and skip sending a command when a setting is set to the value it
+   * already has. Settings are forgotten when the module reboots or a
+   * profile is loaded.
+   *
+   * Call this to forget all settings, so the next setters always send
+   * their command (e.g. when the settings were changed through
+   * writeCommand).
+   */
+  void forgetSettings()
   {
-    return writeCommandCheckOk("AT+NCMAUTOCONF=%d,%d", param, value);
+    this->shadow_valid = 0;
   }
 
   /**
@@ -369,13 +400,19 @@ public:
    * certificate in (binary) DER format. */
   bool addCert(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len);
 
+  /**
+   * Like addCert, but reads the certificate from program memory
+   * (PROGMEM) instead of RAM.
+   */
+  bool addCert_P(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len);
+
   /**
    * Remove the certificate with the given name from either the module's
    * flash or RAM (depending on where it is).
    */
   bool delCert(const char *certname)
   {
-    return writeCommandCheckOk("AT+TCERTDEL=%s", certname);
+    return command(F("AT+TCERTDEL=")).str(certname).checkOk();
   }
 
   /**
@@ -401,6 +438,55 @@ public:
    */
   IPAddress dnsLookup(const char *name);
 
+  /**
+   * Resolve a hostname to an IP address, using a small cache of recent
+   * lookups to prevent a DNS lookup for every call. Strings that are
+   * already an IP address (e.g. "192.168.1.1") are returned directly.
+   *
+   * The module does not report the TTL of a DNS reply, so entries are
+   * kept for a fixed time (see setDnsTtl). When the cache is full, the
+   * least recently used entry is replaced.
+   *
+   * Names longer than MAX_DNS_CACHE_NAME_LEN are not cached.
+   *
+   * @returns the IP address, or 0.0.0.0 when the host was not found.
+   */
+  IPAddress resolve(const char *name);
+
+  /**
+   * Resolve a hostname in the background from loop(), so a later
+   * resolve() call can use the cache. The lookup is done when no other
+   * command is pending.
+   *
+   * @param name  The hostname. This pointer is kept until the lookup is
+   *              done, so the string should stay around until then.
+   *
+   * @returns true when the name is cached or queued for lookup, false
+   *          when the queue is full.
+   */
+  bool prefetchHost(const char *name);
+
+  /** Remove a hostname from the cache, e.g. when its address stopped working */
+  void forgetHost(const char *name);
+
+  /** Remove all hostnames from the cache */
+  void flushDnsCache();
+
+  /**
+   * Set how long resolve() can use a cached address, in seconds. Pass
+   * 0 to disable the cache.
+   */
+  void setDnsTtl(uint16_t seconds) { this->dns_ttl = seconds; }
+
+  static const uint16_t DEFAULT_DNS_TTL = 300;
+  /**
+   * The number of names in the DNS cache and the longest name that is
+   * cached (see GS_DNS_CACHE_SIZE and GS_MAX_DNS_CACHE_NAME_LEN).
+   */
+  static const uint8_t DNS_CACHE_SIZE = GS_DNS_CACHE_SIZE;
+  static const uint8_t DNS_PREFETCH_SIZE = 4;
+  static const uint8_t MAX_DNS_CACHE_NAME_LEN = GS_MAX_DNS_CACHE_NAME_LEN;
+
   /**
    * Setup a new TCP connection to the given ip and port.
    *
@@ -466,7 +552,8 @@ public:
    */
   bool setAutoAssociate(const char *ssid, const char *bssid = NULL, int channel = 0, WMode mode = GS_INFRASTRUCTURE)
   {
-    return writeCommandCheckOk("AT+WAUTO=%d,\"%s\",%s,%d", mode, ssid, bssid ?: "", channel);
+    return command(F("AT+WAUTO=")).num(mode).chr(',').quoted(ssid).chr(',')
+                   .str(bssid ?: "").chr(',').num(channel).checkOk();
   }
 
   enum Protocol {
@@ -549,6 +636,325 @@ public:
    *                        through setAutoAssociate.
    */
   bool setNcm(bool enabled, bool associate_only = true, bool remember = false, NCMMode mode = GS_NCM_STATION);
+
+/*******************************************************
+ * Scanning
+ *******************************************************/
+
+  /** A single access point (or ad-hoc network) found by scan() */
+  struct ScanResult {
+    /** The BSSID (MAC address) */
+    uint8_t bssid[6];
+    /** The SSID, 0-terminated. Trailing spaces are lost. */
+    char ssid[33];
+    uint8_t channel;
+    /** GS_INFRASTRUCTURE or GS_ADHOC */
+    WMode mode;
+    /** Signal strength in dBm */
+    int8_t rssi;
+    /**
+     * One of GS_SECURITY_OPEN, GS_SECURITY_WEP,
+     * GS_SECURITY_WPA[12]_PSK or GS_SECURITY_WPA[12]_ENTERPRISE, or
+     * GS_SECURITY_AUTO when unknown.
+     */
+    GSSecurity security;
+  };
+
+  typedef void (*scan_callback_t)(const ScanResult *result, void *data);
+
+  /**
+   * Scan for wireless networks. The callback is called for every
+   * network found, as soon as it is received from the module.
+   *
+   * @param callback   Called for every network found.
+   * @param data       Passed to the callback.
+   * @param ssid       When not NULL, only look for networks with this
+   *                   SSID (this also finds hidden networks).
+   * @param channels   Bitmask of the channels to scan (bit 1 for
+   *                   channel 1, etc.). 0 scans all channels. Each
+   *                   channel is scanned with a separate command,
+   *                   unless all channels are scanned.
+   * @param scan_time  The time to scan each channel, in milliseconds,
+   *                   or 0 to use the default (see GS_PARAM_SCAN_TIME).
+   *
+   * @returns the number of networks found, or -1 when the scan failed.
+   */
+  int scan(scan_callback_t callback, void *data, const char *ssid = NULL, uint16_t channels = 0, uint16_t scan_time = 0);
+
+/*******************************************************
+ * Network status
+ *******************************************************/
+
+  /** The network status, as reported by AT+NSTAT */
+  struct Status {
+    /**
+     * Are we associated? When false, only mac is valid (the others
+     * are zero).
+     */
+    bool associated;
+    /** The MAC address of the module */
+    uint8_t mac[6];
+    /** The BSSID (MAC address) of the access point */
+    uint8_t bssid[6];
+    /** The SSID, 0-terminated */
+    char ssid[33];
+    uint8_t channel;
+    WMode mode;
+    /** Signal strength in dBm */
+    int8_t rssi;
+    /** See ScanResult::security */
+    GSSecurity security;
+    IPAddress ip;
+    IPAddress netmask;
+    IPAddress gateway;
+    IPAddress dns1;
+    IPAddress dns2;
+  };
+
+  /**
+   * Returns the current network status.
+   *
+   * To prevent a roundtrip to the module for every call, the status is
+   * cached for a while (see setStatusMaxAge). It is always refreshed
+   * when the association state changed.
+   *
+   * @param refresh  When true, always query the module.
+   *
+   * @returns the status, or NULL when it could not be retrieved. The
+   *          status remains valid until the next call.
+   */
+  const Status *getStatus(bool refresh = false);
+
+  /**
+   * Set how long getStatus() can return the cached status, in
+   * milliseconds. Pass 0 to always query the module.
+   */
+  void setStatusMaxAge(uint16_t ms) { this->status_max_age = ms; }
+
+  static const uint16_t DEFAULT_STATUS_MAX_AGE = 1000;
+
+/*******************************************************
+ * Asynchronous versions of some of the above
+ *******************************************************/
+
+  /*
+   * These send the same command as the synchronous method with the
+   * same name, but return right away. The result is reported through
+   * the given AsyncCommand (see GSCore::AsyncCommand), which the caller
+   * should keep around until the command completes. Set its onComplete
+   * and data fields before calling these, if needed. The other fields
+   * are used internally.
+   */
+
+  /** See associate(). cmd->response is GS_SUCCESS when associated. */
+  void associateAsync(AsyncCommand *cmd, const char *ssid, const char *bssid = NULL, uint8_t channel = 0, bool best_rssi = true);
+
+  /** See timeSync(). cmd->response is GS_SUCCESS when succesful. */
+  void timeSyncAsync(AsyncCommand *cmd, const IPAddress& server, uint32_t interval = 0, uint8_t timeout = 10);
+
+  /** See dnsLookup(). The result is stored in cmd->ip. */
+  void dnsLookupAsync(AsyncCommand *cmd, const char *name);
+
+  /**
+   * See connectTcp(). The cid of the new connection (or INVALID_CID) is
+   * stored in cmd->cid.
+   */
+  void connectTcpAsync(AsyncCommand *cmd, const IPAddress& ip, uint16_t port);
+
+  /** See enableTls(). cmd->response is GS_SUCCESS when succesful. */
+  void enableTlsAsync(AsyncCommand *cmd, cid_t cid, const char *certname);
+
+protected:
+  /** Passed to processScanLine() */
+  struct ScanState {
+    scan_callback_t callback;
+    void *data;
+    int count;
+  };
+
+  /** Line callback for scan() */
+  static void processScanLine(const uint8_t *buf, uint16_t len, void *data);
+
+  /** Line callback for getStatus() */
+  static void processNstatLine(const uint8_t *buf, uint16_t len, void *data);
+
+  /** Field callback for processNstatLine() */
+  static void processNstatField(const uint8_t *key, uint16_t key_len, const uint8_t *value, uint16_t value_len, void *data);
+
+  /**
+   * Parse a MAC address of the form "12:34:56:78:9a:bc".
+   */
+  static bool parseMacAddress(uint8_t *mac, const uint8_t *buf, uint16_t len);
+
+  /**
+   * Parse an RSSI value (e.g. "-39").
+   */
+  static bool parseRssi(int8_t *rssi, const uint8_t *buf, uint16_t len);
+
+  /**
+   * Parse a security mode (e.g. "WPA2-PERSONAL"), as reported by
+   * AT+WS and AT+NSTAT.
+   *
+   * @returns the security mode, or GS_SECURITY_AUTO when unknown.
+   */
+  static GSSecurity parseSecurity(const uint8_t *buf, uint16_t len);
+
+  /** The last status retrieved by getStatus() */
+  Status status;
+  /** millis() when status was retrieved */
+  unsigned long status_time;
+  /** Is status valid? */
+  bool status_valid = false;
+  /** The boot_count when status was retrieved */
+  uint8_t status_boot_count;
+  /** See setStatusMaxAge() */
+  uint16_t status_max_age = DEFAULT_STATUS_MAX_AGE;
+
+  /**
+   * The settings remembered by the setters, see forgetSettings(). Each
+   * stores a value in shadow[], settings with multiple values use
+   * multiple consecutive entries.
+   */
+  enum ShadowSetting {
+    SHADOW_AUTH,
+    SHADOW_SECURITY,
+    /**
+     * A ShadowPsk value telling which command set the passphrase
+     * (in shadow_passphrase) and SSID (in shadow_ssid).
+     */
+    SHADOW_PSK,
+    /** Always 0, the key is in shadow_wep */
+    SHADOW_WEP,
+    /**
+     * The enable flag in bit 0 and whether a hostname (in
+     * shadow_hostname) was given in bit 1
+     */
+    SHADOW_DHCP,
+    /** Address, netmask and gateway */
+    SHADOW_STATIC_IP,
+    SHADOW_STATIC_IP_COUNT = 3,
+    /** The number of servers, followed by the servers */
+    SHADOW_DNS = SHADOW_STATIC_IP + SHADOW_STATIC_IP_COUNT,
+    SHADOW_DNS_COUNT = 3,
+    /** One for each GSParam */
+    SHADOW_PARAM = SHADOW_DNS + SHADOW_DNS_COUNT,
+    SHADOW_PARAM_COUNT = GS_PARAM_L4_RETRY_COUNT + 1,
+    /** One for each GSNcmParam */
+    SHADOW_NCM_PARAM = SHADOW_PARAM + SHADOW_PARAM_COUNT,
+    SHADOW_NCM_PARAM_COUNT = GS_NCM_L3_CONNECT_RETRY_COUNT + 1,
+
+    SHADOW_COUNT = SHADOW_NCM_PARAM + SHADOW_NCM_PARAM_COUNT,
+  };
+  static_assert(SHADOW_COUNT <= 32, "shadow_valid is too small for SHADOW_COUNT");
+
+  /** Values for SHADOW_PSK */
+  enum ShadowPsk {
+    /** Set by setWpaPassphrase() */
+    SHADOW_PSK_PASSPHRASE,
+    /** Set by setPskPassphrase() */
+    SHADOW_PSK_SSID,
+  };
+
+  /**
+   * The longest strings remembered for the string settings. Setters
+   * given longer strings always send their command, so setting these
+   * to 0 (e.g. through GS_MAX_SHADOW_SSID_LEN) saves RAM at the cost of
+   * resending those settings.
+   */
+  static const uint8_t MAX_SHADOW_SSID_LEN = GS_MAX_SHADOW_SSID_LEN;
+  static const uint8_t MAX_SHADOW_PASSPHRASE_LEN = GS_MAX_SHADOW_PASSPHRASE_LEN;
+  static const uint8_t MAX_SHADOW_WEP_LEN = GS_MAX_SHADOW_WEP_LEN;
+  static const uint8_t MAX_SHADOW_HOSTNAME_LEN = GS_MAX_SHADOW_HOSTNAME_LEN;
+
+  /**
+   * Returns true when the given setting was last applied with the
+   * given value.
+   */
+  bool shadowMatches(uint8_t setting, uint32_t value);
+
+  /**
+   * Remember the value just applied to the given setting, if the
+   * command succeeded.
+   *
+   * @returns ok
+   */
+  bool shadowUpdate(uint8_t setting, uint32_t value, bool ok);
+
+  struct DnsCacheEntry {
+    /** The hostname, 0-terminated */
+    char name[MAX_DNS_CACHE_NAME_LEN + 1];
+    /** The address, or 0 when this entry is unused */
+    uint32_t ip;
+    /** millis() when the name was resolved */
+    unsigned long resolved;
+    /** millis() when the entry was last used */
+    unsigned long used;
+  };
+
+  /**
+   * Returns the cache entry for the given name, or NULL when the name
+   * is not cached (anymore).
+   */
+  DnsCacheEntry *dnsCacheFind(const char *name);
+
+  /** Store an address in the cache, unless the name is too long */
+  void dnsCacheStore(const char *name, const IPAddress& ip);
+
+  /** Start the lookup of the next name queued by prefetchHost */
+  void startDnsPrefetch();
+
+  /** onComplete callback for the lookups started by startDnsPrefetch */
+  static void finishDnsPrefetch(void *data, AsyncCommand *cmd);
+
+  /** Calls startDnsPrefetch() from loop() while names are queued */
+  class DnsPrefetcher : public LoopHandler {
+    public:
+      DnsPrefetcher(GSModule &gs) : gs(gs) { }
+      virtual void loop() { gs.startDnsPrefetch(); }
+    protected:
+      GSModule &gs;
+  };
+
+  DnsCacheEntry dns_cache[DNS_CACHE_SIZE] = {};
+  /** See setDnsTtl() */
+  uint16_t dns_ttl = DEFAULT_DNS_TTL;
+  /** Names queued by prefetchHost */
+  const char *dns_prefetch[DNS_PREFETCH_SIZE] = {};
+  uint8_t dns_prefetch_len = 0;
+  /** The lookup started by startDnsPrefetch, for dns_prefetch_name */
+  AsyncCommand dns_prefetch_cmd;
+  const char *dns_prefetch_name = NULL;
+  DnsPrefetcher dns_prefetcher{*this};
+
+  /** The values last applied for each ShadowSetting */
+  uint32_t shadow[SHADOW_COUNT];
+  /** Bitmask of the ShadowSettings that have a valid value */
+  uint32_t shadow_valid = 0;
+  /* The strings last applied, see ShadowSetting */
+  char shadow_ssid[MAX_SHADOW_SSID_LEN + 1];
+  char shadow_passphrase[MAX_SHADOW_PASSPHRASE_LEN + 1];
+  char shadow_wep[MAX_SHADOW_WEP_LEN + 1];
+  char shadow_hostname[MAX_SHADOW_HOSTNAME_LEN + 1];
+  /** The boot_count for which shadow_valid is valid */
+  uint8_t shadow_boot_count = 0;
+
+  /* Process the results of the asynchronous commands above */
+  static bool finishAssociate(GSCore &gs, AsyncCommand *cmd);
+  static bool finishTimeSync(GSCore &gs, AsyncCommand *cmd);
+  static bool finishDnsLookup(GSCore &gs, AsyncCommand *cmd);
+  static bool finishConnectTcp(GSCore &gs, AsyncCommand *cmd);
+  static bool finishEnableTls(GSCore &gs, AsyncCommand *cmd);
+
+  /**
+   * Implementation of addCert and addCert_P. When progmem is true, buf
+   * points into program memory.
+   */
+  bool addCertInternal(const char *certname, bool to_flash, const uint8_t *buf, uint16_t len, bool progmem);
+
+  /* Apply the effects of setNcm(), see Command::checkOk() */
+  static void ncmConnectEnabled(GSCore &gs);
+  static void ncmAssociateEnabled(GSCore &gs);
+  static void ncmDisabled(GSCore &gs);
 };
 
 #endif // GS_MODULE_H
@@ -26,12 +26,25 @@
 
 #include "GSTcpClient.h"
 
+GSTcpClient::~GSTcpClient()
+{
+  // connect_cmd must not be used anymore once we are gone
+  if (connecting())
+    gs.waitAsyncCommand();
+}
+
 int GSTcpClient::connect(IPAddress ip, uint16_t port)
 {
-  if (connected())
+  if (connected() || connecting())
     return false;
 
-  GSModule::cid_t cid = gs.connectTcp(ip, port);
+  unsigned long start = millis();
+  GSModule::cid_t cid;
+  if (this->pool)
+    cid = this->pool->checkout(ip, port);
+  else
+    cid = gs.connectTcp(ip, port);
+  this->connect_time = millis() - start;
   if (cid == GSModule::INVALID_CID)
     return false;
 
@@ -39,20 +52,94 @@ int GSTcpClient::connect(IPAddress ip, uint16_t port)
   return true;
 }
 
+bool GSTcpClient::connectAsync(IPAddress ip, uint16_t port, const char *certname)
+{
+  if (connected() || connecting())
+    return false;
+
+  this->certname = certname;
+  this->connect_state = CONNECT_TCP;
+  this->connect_start = millis();
+  this->connect_cmd.onComplete = connectAsyncDone;
+  this->connect_cmd.data = this;
+  gs.connectTcpAsync(&this->connect_cmd, ip, port);
+  return true;
+}
+
+void GSTcpClient::connectAsyncDone(void *data, GSCore::AsyncCommand *cmd)
+{
+  GSTcpClient *client = (GSTcpClient*)data;
+  uint32_t elapsed = millis() - client->connect_start;
+
+  if (client->connect_state == CONNECT_TCP) {
+    client->connect_time = elapsed;
+    if (cmd->cid != GSModule::INVALID_CID && client->certname) {
+      // Continue with the TLS handshake, reusing the same command. The
+      // cid is only set afterwards, so connected() stays false until
+      // no more plaintext data can be sent.
+      client->connect_state = CONNECT_TLS;
+      client->connect_start = millis();
+      client->gs.enableTlsAsync(cmd, cmd->cid, client->certname);
+      return;
+    }
+    client->cid = cmd->cid;
+  } else {
+    client->tls_time = elapsed;
+    // On failure, the module already closed the connection
+    if (cmd->response == GSModule::GS_SUCCESS)
+      client->cid = cmd->cid;
+  }
+
+  client->connect_state = CONNECT_IDLE;
+}
+
 int GSTcpClient::connect(const char *host, uint16_t port)
 {
-  // TODO
+  if (connected())
+    return false;
+
+  IPAddress ip = gs.resolve(host);
+  if (!(uint32_t)ip)
+    return false;
+
+  if (connect(ip, port))
+    return true;
+
+  // The cached address might be stale, look it up again next time
+  gs.forgetHost(host);
   return false;
 }
 
+void GSTcpClient::stop()
+{
+  // Let a pending connectAsync finish, so the connection can be closed
+  if (connecting())
+    gs.waitAsyncCommand();
+
+  if (!this->pool || this->cid == GSModule::INVALID_CID) {
+    GSClient::stop();
+    return;
+  }
+
+  // Make sure all data is sent before someone else gets the connection
+  flush();
+  this->pool->release(this->cid);
+  this->cid = GSModule::INVALID_CID;
+}
+
 bool GSTcpClient::enableTls(const char *certname)
 {
-  return gs.enableTls(this->cid, certname);
+  unsigned long start = millis();
+  bool ok = gs.enableTls(this->cid, certname);
+  this->tls_time = millis() - start;
+  return ok;
 }
 
 uint8_t GSTcpClient::sslConnected()
 {
   if (this->cid == GSModule::INVALID_CID)
     return false;
-  return gs.getConnectionInfo(this->cid).connected && gs.getConnectionInfo(this->cid).ssl;
+  gs.refreshState();
+  const GSCore::ConnectionInfo &info = gs.getCachedConnectionInfo(this->cid);
+  return info.connected && info.ssl;
 }
@@ -28,16 +28,27 @@
 #define _GS_TCP_CLIENT_H
 
 #include "GSClient.h"
+#include "GSTcpPool.h"
 
 class GSTcpClient : public  GSClient {
   public:
     GSTcpClient(GSModule &gs) : GSClient(gs) { } ;
 
+    /**
+     * Create a client that gets its connections from the given pool,
+     * and hands them back to the pool in stop() instead of closing
+     * them. See GSTcpPool.
+     */
+    GSTcpClient(GSModule &gs, GSTcpPool &pool) : GSClient(gs), pool(&pool) { } ;
+
+    ~GSTcpClient();
+
     /****************************************************************
      * Stuff from Client that is not implemented by GSClient yet
      ****************************************************************/
     virtual int connect(IPAddress ip, uint16_t port);
     virtual int connect(const char *host, uint16_t port);
+    virtual void stop();
 
 
     /****************************************************************
@@ -46,9 +57,69 @@ class GSTcpClient : public  GSClient {
     virtual uint8_t sslConnected();
     virtual bool enableTls(const char *certname);
 
+    /**
+     * Start connecting to the given ip and port, and optionally enable
+     * TLS after that, without waiting for the module. The connection is
+     * completed from GSModule::loop(), so that must be called
+     * regularly. While connecting() returns true, connected() returns
+     * false. Afterwards, connected() (and sslConnected() when TLS was
+     * requested) tell whether it succeeded.
+     *
+     * Note that the module handles one command at a time, so other
+     * commands (on any cid) wait until the connection is completed.
+     * Data for other cids is still processed by loop() in the
+     * meanwhile. The connection pool (if any) is not used.
+     *
+     * @param certname  If not NULL, the name of the CA certificate to
+     *                  enable TLS with (see enableTls). The string
+     *                  should stay around until connecting() is false.
+     *
+     * @returns true when connecting was started.
+     */
+    bool connectAsync(IPAddress ip, uint16_t port, const char *certname = NULL);
+
+    /**
+     * Returns true while a connection started by connectAsync() is not
+     * completed yet.
+     */
+    uint8_t connecting() { return this->connect_state != CONNECT_IDLE; }
+
+    /**
+     * Returns how long the last TCP connect took, in milliseconds.
+     */
+    uint32_t getConnectTime() { return this->connect_time; }
+
+    /**
+     * Returns how long the last TLS handshake took, in milliseconds.
+     */
+    uint32_t getTlsTime() { return this->tls_time; }
+
     // Explicitely inherit operator=, since the default assignment
     // operator shows it.
     using GSClient::operator=;
+
+  protected:
+    enum ConnectState {
+      CONNECT_IDLE,
+      /** Waiting for the reply to AT+NCTCP */
+      CONNECT_TCP,
+      /** Waiting for the reply to AT+SSLOPEN */
+      CONNECT_TLS,
+    };
+
+    /** onComplete callback for connect_cmd */
+    static void connectAsyncDone(void *data, GSCore::AsyncCommand *cmd);
+
+    GSTcpPool *pool = NULL;
+
+    /** Used by connectAsync */
+    GSCore::AsyncCommand connect_cmd;
+    ConnectState connect_state = CONNECT_IDLE;
+    const char *certname = NULL;
+    /** millis() when the current connection step was started */
+    unsigned long connect_start;
+    uint32_t connect_time = 0;
+    uint32_t tls_time = 0;
 };
 
 #endif // _GS_TCP_CLIENT_H
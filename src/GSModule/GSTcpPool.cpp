@@ -0,0 +1,179 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "GSTcpPool.h"
+
+GSTcpPool::GSTcpPool(GSModule &gs) : gs(gs)
+{
+  for (uint8_t i = 0; i < MAX_CONNECTIONS; ++i)
+    this->entries[i].cid = GSCore::INVALID_CID;
+}
+
+GSTcpPool::~GSTcpPool()
+{
+  closeIdle();
+  this->gs.removeLoopHandler(this);
+}
+
+bool GSTcpPool::isHealthy(const Entry *entry)
+{
+  // getConnectionInfo processes pending async messages, so we know
+  // about disconnects
+  const GSCore::ConnectionInfo &info = this->gs.getConnectionInfo(entry->cid);
+
+  // The cid might have been reused for another connection after a
+  // disconnect, even one to the same destination
+  if (this->gs.getCidGeneration(entry->cid) != entry->generation)
+    return false;
+
+  if (!info.connected || info.error || info.remote_ip != entry->ip || info.remote_port != entry->port)
+    return false;
+
+  return !(this->gs.cidsWithData() & (1 << entry->cid));
+}
+
+void GSTcpPool::close(Entry *entry)
+{
+  // Don't bother the module when it already closed the connection, and
+  // leave the cid alone when it was reused for another connection
+  if (this->gs.getCachedConnectionInfo(entry->cid).connected
+      && this->gs.getCidGeneration(entry->cid) == entry->generation)
+    this->gs.disconnect(entry->cid);
+  entry->cid = GSCore::INVALID_CID;
+}
+
+GSTcpPool::Entry *GSTcpPool::findFreeEntry()
+{
+  Entry *oldest = NULL;
+  for (uint8_t i = 0; i < MAX_CONNECTIONS; ++i) {
+    Entry *entry = &this->entries[i];
+    if (entry->cid == GSCore::INVALID_CID)
+      return entry;
+    if (!entry->in_use && (!oldest || (long)(entry->idle_since - oldest->idle_since) < 0))
+      oldest = entry;
+  }
+
+  if (oldest)
+    close(oldest);
+  return oldest;
+}
+
+GSCore::cid_t GSTcpPool::checkout(const IPAddress& ip, uint16_t port)
+{
+  unsigned long start = micros();
+
+  for (uint8_t i = 0; i < MAX_CONNECTIONS; ++i) {
+    Entry *entry = &this->entries[i];
+    if (entry->cid == GSCore::INVALID_CID || entry->in_use)
+      continue;
+    if (entry->ip != (uint32_t)ip || entry->port != port)
+      continue;
+
+    if (!isHealthy(entry)) {
+      close(entry);
+      continue;
+    }
+
+    entry->in_use = true;
+    this->stats.warm++;
+    this->stats.warm_us += micros() - start;
+    return entry->cid;
+  }
+
+  GSCore::cid_t cid = this->gs.connectTcp(ip, port);
+  if (cid == GSCore::INVALID_CID)
+    return GSCore::INVALID_CID;
+
+  // When all entries are in use, the connection is not pooled and
+  // simply closed by release()
+  Entry *entry = findFreeEntry();
+  if (entry) {
+    entry->cid = cid;
+    entry->in_use = true;
+    entry->generation = this->gs.getCidGeneration(cid);
+    entry->ip = ip;
+    entry->port = port;
+  }
+
+  this->stats.cold++;
+  this->stats.cold_us += micros() - start;
+  return cid;
+}
+
+void GSTcpPool::release(GSCore::cid_t cid)
+{
+  if (cid > GSCore::MAX_CID)
+    return;
+
+  for (uint8_t i = 0; i < MAX_CONNECTIONS; ++i) {
+    Entry *entry = &this->entries[i];
+    if (entry->cid != cid || !entry->in_use)
+      continue;
+
+    if (!isHealthy(entry)) {
+      close(entry);
+      return;
+    }
+
+    entry->in_use = false;
+    entry->idle_since = millis();
+    this->gs.addLoopHandler(this);
+    return;
+  }
+
+  // Not one of ours
+  this->gs.disconnect(cid);
+}
+
+void GSTcpPool::closeIdle()
+{
+  for (uint8_t i = 0; i < MAX_CONNECTIONS; ++i) {
+    Entry *entry = &this->entries[i];
+    if (entry->cid != GSCore::INVALID_CID && !entry->in_use)
+      close(entry);
+  }
+}
+
+void GSTcpPool::loop()
+{
+  bool idle = false;
+  for (uint8_t i = 0; i < MAX_CONNECTIONS; ++i) {
+    Entry *entry = &this->entries[i];
+    if (entry->cid == GSCore::INVALID_CID || entry->in_use)
+      continue;
+
+    if ((unsigned long)(millis() - entry->idle_since) >= this->idle_timeout || !isHealthy(entry))
+      close(entry);
+    else
+      idle = true;
+  }
+
+  // Only keep checking while there are idle connections
+  if (!idle)
+    this->gs.removeLoopHandler(this);
+}
+
+// vim: set sw=2 sts=2 expandtab:
@@ -0,0 +1,153 @@
+/*
+ * Arduino library for Gainspan Wifi2Serial modules
+ *
+ * Copyright (C) 2014 Matthijs Kooijman <matthijs@stdin.nl>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _GS_TCP_POOL_H
+#define _GS_TCP_POOL_H
+
+#include <Arduino.h>
+
+#include "GSModule.h"
+
+/**
+ * A pool of TCP connections that are kept open after use, so a later
+ * connection to the same IP address and port can reuse them instead of
+ * setting up a new connection.
+ *
+ * Normally, this is used through GSTcpClient: a GSTcpClient created
+ * with a pool gets its connection from the pool in connect(), and
+ * hands it back in stop(). e.g.,
+ *
+ *    GSTcpPool pool(gs);
+ *    GSTcpClient client(gs, pool);
+ *
+ *    client.connect(ip, 80);
+ *    client.print(request);
+ *    ... read the reply ...
+ *    client.stop();
+ *
+ * Only use this when the server keeps the connection open after a
+ * reply (e.g., HTTP keep-alive). Idle connections that are closed by
+ * the server are noticed and removed, but a connection can still be
+ * closed just after it was handed out, so be prepared for failures.
+ */
+class GSTcpPool : protected GSCore::LoopHandler {
+  public:
+    GSTcpPool(GSModule &gs);
+    ~GSTcpPool();
+
+    /** The maximum number of connections managed by the pool */
+    static const uint8_t MAX_CONNECTIONS = 4;
+
+    /** The default for setIdleTimeout, in milliseconds */
+    static const uint16_t DEFAULT_IDLE_TIMEOUT = 10000;
+
+    /**
+     * Get a connection to the given IP address and port. This returns
+     * an idle connection from the pool when there is a healthy one, or
+     * sets up a new connection otherwise.
+     *
+     * @returns the cid of the connection, or INVALID_CID when no
+     *          connection could be made.
+     */
+    GSCore::cid_t checkout(const IPAddress& ip, uint16_t port);
+
+    /**
+     * Hand back a connection returned by checkout(). It is kept open
+     * for reuse when it is still healthy, closed otherwise. The caller
+     * should not use the cid anymore.
+     *
+     * Connections with received data that was not read are closed as
+     * well, since a new user would receive that data.
+     */
+    void release(GSCore::cid_t cid);
+
+    /** Close all idle connections. */
+    void closeIdle();
+
+    /**
+     * Set how long an unused connection is kept open, in milliseconds.
+     * Idle connections are closed from GSModule::loop(), so that must
+     * be called regularly.
+     */
+    void setIdleTimeout(uint16_t ms) { this->idle_timeout = ms; }
+
+    /**
+     * Statistics about checkout(), to compare the latency of reused
+     * (warm) connections with new (cold) connections.
+     */
+    struct Stats {
+      /** The number of checkouts that reused a connection */
+      uint16_t warm;
+      /** The number of checkouts that made a new connection */
+      uint16_t cold;
+      /** Total time spent in warm checkouts, in microseconds */
+      uint32_t warm_us;
+      /** Total time spent in cold checkouts, in microseconds */
+      uint32_t cold_us;
+    };
+
+    const Stats& getStats() { return this->stats; }
+    void resetStats() { this->stats = Stats(); }
+
+  protected:
+    struct Entry {
+      /** The connection, or INVALID_CID when this entry is unused */
+      GSCore::cid_t cid;
+      /** Is the connection checked out currently? */
+      bool in_use;
+      /** GSCore::getCidGeneration() for cid when it was connected */
+      uint8_t generation;
+      uint32_t ip;
+      uint16_t port;
+      /** millis() when the connection was released */
+      unsigned long idle_since;
+    };
+
+    /**
+     * Check if the connection of the given entry is still the one it
+     * was set up with and still connected, without errors or unread
+     * data.
+     */
+    bool isHealthy(const Entry *entry);
+
+    /** Close the connection of the given entry and free the entry. */
+    void close(Entry *entry);
+
+    /** Returns an unused entry, closing the oldest idle one if needed. */
+    Entry *findFreeEntry();
+
+    /** Closes idle connections that timed out or broke */
+    virtual void loop();
+
+    GSModule &gs;
+    Entry entries[MAX_CONNECTIONS];
+    uint16_t idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    Stats stats = Stats();
+};
+
+#endif // _GS_TCP_POOL_H
+
+// vim: set sw=2 sts=2 expandtab:
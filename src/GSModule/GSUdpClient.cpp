@@ -41,6 +41,17 @@ int GSUdpClient::connect(IPAddress ip, uint16_t port)
 
 int GSUdpClient::connect(const char *host, uint16_t port)
 {
-  // TODO
+  if (connected())
+    return false;
+
+  IPAddress ip = gs.resolve(host);
+  if (!(uint32_t)ip)
+    return false;
+
+  if (connect(ip, port))
+    return true;
+
+  // The cached address might be stale, look it up again next time
+  gs.forgetHost(host);
   return false;
 }
@@ -31,7 +31,12 @@
 
 class GSUdpClient : public  GSClient {
   public:
-    GSUdpClient(GSModule &gs) : GSClient(gs) { } ;
+    GSUdpClient(GSModule &gs) : GSClient(gs)
+    {
+      // Every write should result in a single packet, so don't collect
+      // writes in the transmit buffer
+      this->no_delay = true;
+    }
 
     /****************************************************************
      * Stuff from Client that is not implemented by GSClient yet
@@ -66,6 +66,10 @@ uint16_t GSUdpServer::remotePort()
 
 int GSUdpServer::beginPacket(IPAddress ip, uint16_t port)
 {
+  // Drop any packet that was started but never ended
+  this->tx_len = 0;
+  clearWriteError();
+
   this->tx_ip = ip;
   this->tx_port = port;
 
@@ -74,6 +78,9 @@ int GSUdpServer::beginPacket(IPAddress ip, uint16_t port)
 
 int GSUdpServer::beginPacket(const char *host, uint16_t port)
 {
+  this->tx_len = 0;
+  clearWriteError();
+
   if (!GSCore::parseIpAddress(&(this->tx_ip), host, strlen(host))) return false;
   this->tx_port = port;
   return true;
@@ -81,37 +88,69 @@ int GSUdpServer::beginPacket(const char *host, uint16_t port)
 
 int GSUdpServer::endPacket()
 {
-  int res = this->gs.writeData(this->cid, this->tx_ip, this->tx_port, this->tx_buf, this->tx_len);
-  free(this->tx_buf);
-  this->tx_buf = NULL;
+  // Don't send a truncated packet if some data did not fit
+  int res = false;
+  if (!getWriteError())
+    res = this->gs.writeData(this->cid, this->tx_ip, this->tx_port, this->tx_buf, this->tx_len);
+
+  clearWriteError();
   this->tx_len = 0;
   return res;
 }
 
 size_t GSUdpServer::write(uint8_t c)
 {
-  uint8_t *newbuf = (uint8_t*)realloc(this->tx_buf, this->tx_len + 1);
-  if (!newbuf)
-    return 0;
-
-  this->tx_buf = newbuf;
-  this->tx_buf[this->tx_len++] = c;
-  return 1;
+  return write(&c, 1);
 }
 
 size_t GSUdpServer::write(const uint8_t *buf, size_t size)
 {
-  uint8_t *newbuf = (uint8_t*)realloc(this->tx_buf, this->tx_len + size);
-  if (!newbuf)
+  if (!allocTxBuffer() || size > (size_t)(this->tx_size - this->tx_len)) {
+    setWriteError();
     return 0;
+  }
 
-  this->tx_buf = newbuf;
   memcpy(this->tx_buf + this->tx_len, buf, size);
   this->tx_len += size;
 
   return size;
 }
 
+void GSUdpServer::setTxBuffer(uint8_t *buf, uint16_t size)
+{
+  if (this->tx_buf_allocated)
+    free(this->tx_buf);
+
+  this->tx_buf = buf;
+  this->tx_size = size;
+  if (size > MAX_PACKET_SIZE)
+    this->tx_size = MAX_PACKET_SIZE;
+  this->tx_buf_allocated = false;
+  this->tx_len = 0;
+  clearWriteError();
+}
+
+bool GSUdpServer::allocTxBuffer()
+{
+  if (this->tx_buf)
+    return true;
+
+  // Allocate once and keep it, to prevent heap fragmentation
+  this->tx_buf = (uint8_t*)malloc(MAX_PACKET_SIZE);
+  if (!this->tx_buf)
+    return false;
+
+  this->tx_size = MAX_PACKET_SIZE;
+  this->tx_buf_allocated = true;
+  return true;
+}
+
+GSUdpServer::~GSUdpServer()
+{
+  if (this->tx_buf_allocated)
+    free(this->tx_buf);
+}
+
 int GSUdpServer::available()
 {
   return this->rx_frame.length;
@@ -157,6 +196,48 @@ void GSUdpServer::stop()
   gs.disconnect(this->cid);
 }
 
+int GSUdpServer::recvFrom(uint8_t *buf, size_t size, IPAddress *ip, uint16_t *port)
+{
+  // getFrameHeader returns an empty frame when there is no packet, so a
+  // packet without data cannot be told apart from no packet at all.
+  if (!parsePacket())
+    return -1;
+
+  if (ip)
+    *ip = this->rx_frame.ip;
+  if (port)
+    *port = this->rx_frame.port;
+
+  size_t len = this->rx_frame.length;
+  if (len > size)
+    len = size;
+
+  // The frame header has been received, so the rest of the packet
+  // should follow shortly. Keep reading until we have all of it (or as
+  // much as fits), but don't wait long when the module stops sending.
+  size_t done = 0;
+  unsigned long start = millis();
+  while (done < len) {
+    size_t read = this->gs.readData(this->cid, buf + done, len - done);
+    this->rx_frame.length -= read;
+    done += read;
+
+    if (this->gs.unrecoverableError)
+      break;
+    if (!read && (unsigned long)(millis() - start) > RECV_TIMEOUT)
+      break;
+  }
+
+  // Any bytes that did not fit are left in rx_frame and dropped by the
+  // next parsePacket() call.
+  return done;
+}
+
+bool GSUdpServer::sendTo(const IPAddress& ip, uint16_t port, const uint8_t *buf, uint16_t len)
+{
+  return this->gs.writeData(this->cid, ip, port, buf, len);
+}
+
 GSUdpServer& GSUdpServer::operator =(GSCore::cid_t cid)
 {
   this->cid = cid;
@@ -36,6 +36,21 @@ class GSUdpServer : public UDP {
   public:
     GSUdpServer(GSModule &gs) : gs(gs), cid(GSModule::INVALID_CID) { } ;
 
+    /**
+     * Create a server that builds outgoing packets in the given buffer,
+     * instead of allocating one. See setTxBuffer().
+     */
+    GSUdpServer(GSModule &gs, uint8_t *buf, uint16_t size) : gs(gs), cid(GSModule::INVALID_CID)
+    {
+      setTxBuffer(buf, size);
+    }
+
+    ~GSUdpServer();
+
+    // A copy would share (and free) the same packet buffer
+    GSUdpServer(const GSUdpServer&) = delete;
+    GSUdpServer& operator =(const GSUdpServer&) = delete;
+
     /****************************************************************
      * Stuff from Udp / Stream / Print
      ****************************************************************/
@@ -60,10 +75,87 @@ class GSUdpServer : public UDP {
     virtual void flush();
     GSUdpServer& operator =(GSCore::cid_t cid);
 
+    /****************************************************************
+     * Gainspan-specific stuff
+     ****************************************************************/
+
+    /**
+     * Receive a single datagram, without going through
+     * parsePacket/remoteIP/remotePort/read.
+     *
+     * Any unread bytes from a previous packet are dropped first. If
+     * the packet is bigger than size, the remaining bytes are dropped as
+     * well (on the next call to recvFrom or parsePacket).
+     *
+     * @param buf     The buffer to store the packet data in.
+     * @param size    The number of bytes available in buf.
+     * @param ip      If not NULL, the sender's address is stored here.
+     * @param port    If not NULL, the sender's port is stored here.
+     *
+     * The frame header of a packet arrives before its data. recvFrom
+     * waits at most RECV_TIMEOUT milliseconds for the rest of the data,
+     * so it can return fewer bytes than the packet contains. The
+     * remaining bytes are dropped like above.
+     *
+     * @returns the number of bytes stored in buf (which can be 0 when
+     *          size is 0), or -1 when no packet is available. Packets
+     *          without any data are not reported by the module framing,
+     *          so these are never returned.
+     */
+    int recvFrom(uint8_t *buf, size_t size, IPAddress *ip, uint16_t *port);
+
+    /**
+     * The maximum time recvFrom waits for the data of a packet after its
+     * frame header was received, in milliseconds.
+     */
+    static const uint16_t RECV_TIMEOUT = 100;
+
+    /**
+     * Send a single datagram directly, without copying it into the
+     * packet buffer used by beginPacket/write/endPacket.
+     *
+     * @returns whether the packet could be succesfully written.
+     */
+    bool sendTo(const IPAddress& ip, uint16_t port, const uint8_t *buf, uint16_t len);
+
+    /**
+     * The biggest packet that can be sent. This is a hardware limit,
+     * packets cannot be split over multiple data frames.
+     */
+    static const uint16_t MAX_PACKET_SIZE = GSCore::MAX_DATA_FRAME_SIZE;
+
+    /**
+     * Set the buffer to build packets in when using beginPacket /
+     * write / endPacket. The size of the buffer limits the size of the
+     * packets that can be sent, anything written beyond that is
+     * dropped and makes endPacket() fail.
+     *
+     * When no buffer is set, a buffer of MAX_PACKET_SIZE bytes is
+     * allocated the first time a packet is written and kept until
+     * this GSUdpServer is destroyed. Set a (smaller) buffer to prevent
+     * this allocation.
+     *
+     * Any packet data written already is discarded.
+     *
+     * @param buf     The buffer to use. The caller should keep it
+     *                around for as long as this GSUdpServer is used.
+     * @param size    The size of the buffer. Anything beyond
+     *                MAX_PACKET_SIZE is not used.
+     */
+    void setTxBuffer(uint8_t *buf, uint16_t size);
+
     // Include other overloads of write
     using Print::write;
 
   protected:
+    /**
+     * Make sure tx_buf is set, allocating it when needed.
+     *
+     * @returns true when there is a buffer, false when allocation
+     *          failed.
+     */
+    bool allocTxBuffer();
+
     GSModule &gs;
     GSModule::cid_t cid = GSModule::INVALID_CID;
     // Packet currently being received. When length is 0, the other
@@ -75,8 +167,12 @@ class GSUdpServer : public UDP {
     uint16_t tx_port = 0;
     // Buffer into which we're accumulating the next packet.
     uint8_t *tx_buf = NULL;
-    // Length of data in sendBuf
-    size_t tx_len = 0;
+    // Size of tx_buf
+    uint16_t tx_size = 0;
+    // Length of data in tx_buf
+    uint16_t tx_len = 0;
+    // Was tx_buf allocated by us (and should it be freed)?
+    bool tx_buf_allocated = false;
 
 };
 